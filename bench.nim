@@ -0,0 +1,69 @@
+#====================================================================
+#
+#             TinyRE - A Tiny Regex Engine for Nim
+#              Copyright (c) Chen Kai-Hung, Ward
+#
+#====================================================================
+
+# Benchmark of the matching engine and the compiler, reports the best time
+# per input byte and per pattern byte.
+# nim c -r -d:release -d:danger --opt:speed bench.nim
+
+import tinyre
+import std/[monotimes, times, strformat]
+from std/strutils import repeat
+
+proc sample(size: int): string =
+  const words = ["hello ", "world ", "foo@bar.com ", "http://example.org/path?q=1 ",
+    "192.168.0.1 ", "the ", "quick\n", "\"quoted field value\" ", "12345 ",
+    "lorem ipsum dolor sit amet "]
+  var x = 7'u32
+  while result.len < size:
+    x = x * 1103515245'u32 + 12345'u32
+    result.add words[int(x shr 8) mod words.len]
+  result.setLen(size)
+
+proc bench(name: string, pattern: Re, text: string, runs = 5) =
+  var
+    best = float.high
+    count = 0
+  for r in 0 ..< runs:
+    count = 0
+    let start = getMonoTime()
+    for slice in bounds(text, pattern):
+      count.inc
+    best = min(best, float inNanoseconds(getMonoTime() - start))
+  let perByte = best / float text.len
+  echo fmt"{name:<10} {perByte:8.2f} ns/byte {count:>8} captures"
+
+proc generated(size: int, branch: proc (i: int): string): string =
+  result = "(?:"
+  var i = 0
+  while result.len < size:
+    if i != 0: result.add '|'
+    result.add branch(i)
+    i.inc
+  result.add ')'
+
+proc benchCompile(name: string, pattern: string, runs = 5) =
+  var best = float.high
+  for r in 0 ..< runs:
+    let start = getMonoTime()
+    discard re(pattern)
+    best = min(best, float inNanoseconds(getMonoTime() - start))
+  let perByte = best / float pattern.len
+  echo fmt"{name:<10} {perByte:8.2f} ns/byte {pattern.len:>8} bytes"
+
+when isMainModule:
+  let text = sample(1 shl 20)
+  bench("email", reG"[\w\.+-]+@[\w\.-]+\.[\w\.-]+", text)
+  bench("uri", reG"[\w]+://[^/\s?#]+[^\s?#]+(?:\?[^\s#]*)?(?:#[^\s]*)?", text)
+  bench("ipv4", reG"(?:(?:25[0-5]|2[0-4][0-9]|[01]?[0-9][0-9])\.){3}(?:25[0-5]|2[0-4][0-9]|[01]?[0-9][0-9])", text)
+  bench("quoted", reG"""\"[^\"]*\"""", text)
+  bench("words", reG"[a-z]+ing|\d{3,}", text)
+  bench("line", reG".*$", text)
+  bench("zip", reG"\d{3}-\d{4}", text)
+
+  benchCompile("alt", generated(100_000, proc (i: int): string = fmt"key{i}=\d+"))
+  benchCompile("groups", generated(10_000, proc (i: int): string = fmt"(w{i}[a-z]*\s?)+"))
+  benchCompile("nested", "(?:".repeat(20_000) & "a" & ")?".repeat(20_000))
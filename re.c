@@ -82,7 +82,9 @@ struct rcode
   int presub; /* interim val = save count; final val = 1 rsub size */
   int splits; /* number of split insts */
   int sparsesz; /* sdense size */
-  int insts[];  /* re code */
+  int classes; /* offset of the class table in insts */
+  int clen; /* number of integers in the class table */
+  int insts[];  /* re code, then the class table */
 };
 
 enum
@@ -123,13 +125,33 @@ struct rthread
   rsub *sub;
 };
 
-#define INSERT_CODE(at, num, pc) \
-if (code) \
-  memmove(code + at + num, code + at, (pc - at)*sizeof(int)); \
-pc += num;
-#define REL(at, to) (to - at - 2)
-#define EMIT(at, byte) (code ? (code[at] = byte) : at)
-#define PC (prog->unilen)
+/*
+  CLASS takes the offset of its entry in the class table as arg, so that
+  the program stays compact. An entry is a bitmap of the first 256
+  characters, followed by "classnot" byte, "# of pairs" byte and pairs.
+*/
+#define CLASSMAP 8
+
+static int _classitem(const int *pc, int c, int insensitive)
+{
+  /* pc points to a pair of the class */
+  if (*pc == -1) {
+    switch(pc[1]) {
+    case 'd': return isdigit(c);
+    case 'D': return !isdigit(c);
+    case 's': return isspace(c);
+    case 'S': return !isspace(c);
+    case 'w': return isasciiword(c);
+    case 'W': return !isasciiword(c);
+    }
+    return 0;
+  } else if (!insensitive) {
+    return c >= *pc && c <= pc[1];
+  } else {
+    c = tolower(c);
+    return c >= tolower(*pc) && c <= tolower(pc[1]);
+  }
+}
 
 static int re_classmatch(const int *pc, int c, int insensitive)
 {
@@ -137,26 +159,20 @@ static int re_classmatch(const int *pc, int c, int insensitive)
   int is_positive = *pc++;
   int cnt = *pc++;
   while (cnt--) {
-    if (*pc == -1) {
-      switch(pc[1]) {
-      case 'd': if (isdigit(c)) return is_positive; break;
-      case 'D': if (!isdigit(c)) return is_positive; break;
-      case 's': if (isspace(c)) return is_positive; break;
-      case 'S': if (!isspace(c)) return is_positive; break;
-      case 'w': if (isasciiword(c)) return is_positive; break;
-      case 'W': if (!isasciiword(c)) return is_positive; break;
-      }
-    } else if (!insensitive) {
-      if (c >= *pc && c <= pc[1]) return is_positive;
-    } else {
-      c = tolower(c);
-      if (c >= tolower(*pc) && c <= tolower(pc[1])) return is_positive;
-    }
+    if (_classitem(pc, c, insensitive)) return is_positive;
     pc += 2;
   }
   return !is_positive;
 }
 
+static int re_class(const int *cls, int c, int insensitive)
+{
+  /* cls points to the class entry */
+  if ((unsigned int)c < 256)
+    return ((const unsigned int *)cls)[c >> 5] >> (c & 31) & 1;
+  return re_classmatch(cls + CLASSMAP, c, insensitive);
+}
+
 static int _toi(int x) {
   return isdigit(x) ? x - '0' : x - 'a' + 10;
 }
@@ -208,50 +224,240 @@ static int token(const char *re0, int* forward, int utf8) {
   }
 }
 
-static int _compilecode(const char *re_loc, rcode *prog, int sizecode, int utf8)
+/*
+  The pattern is parsed in one pass into a tree, then the code is generated
+  from the tree in another one. A leaf is an instruction (op is its opcode),
+  the other nodes are below. Their sizes are known once they are parsed, so
+  every jump is emitted with its final offset.
+*/
+enum
 {
-  const char *re = re_loc;
-  int *code = sizecode ? NULL : prog->insts;
-  int start = PC, term = PC;
-  int alt_label = 0, c;
-  int alt_stack[4096], altc = 0;
-  int cap_stack[4096 * 5], capc = 0;
-  int n, ch;
+  NCAT = RSPLIT + 1, /* child: first item, linked by next */
+  NALT,    /* child: first branch (NCAT), linked by next; arg: # of branches */
+  NGROUP,  /* child: NCAT or NALT; arg: capture index, 0 = none */
+  NQUEST,  /* child: the item; arg: lazy */
+  NSTAR,
+  NPLUS,
+  NREPEAT, /* child: the item, -1 = nothing; arg: lazy; min, max (-1 = none) */
+};
+
+#define MAXCODE (1 << 26) /* limit of the code size, in integers */
+#define MAXSUB (1 << 28) /* limit of the rsub arena of the VM, in bytes */
+
+typedef struct rnode rnode;
+struct rnode
+{
+  int op;
+  int arg;
+  int size;  /* number of integers in its code */
+  int child;
+  int next;
+  int min;
+  int max;
+};
+
+typedef struct rframe rframe;
+struct rframe
+{
+  int group;   /* NGROUP node, -1 = the whole pattern */
+  int first;   /* first branch */
+  int branch;  /* current branch */
+  int last;    /* last item of the current branch, -1 = none */
+  int term;    /* item the next quantifier applies to, -1 = nothing */
+  int nbranch; /* number of branches */
+  int size;    /* size of the branches before the current one */
+};
+
+typedef struct rtree rtree;
+struct rtree
+{
+  rnode *nodes;
+  int nnode, ncap;
+  int *cls;  /* the class table */
+  int clen, ccap;
+  int root;
+  int nsub;
+  unsigned int esc[6][CLASSMAP]; /* maps of \d\D\s\S\w\W */
+  int hasesc;                    /* bit i: esc[i] is done */
+};
+
+static void re_classmap(rtree *t, int *cls, int insensitive)
+{
+  /* cache the class for the first 256 characters, a pair at a time */
+  unsigned int *map = (unsigned int *)cls, *esc;
+  const int *pc = cls + CLASSMAP + 2;
+  int c, i, cnt;
+  memset(map, 0, CLASSMAP * sizeof(int));
+  for (cnt = cls[CLASSMAP + 1]; cnt--; pc += 2) {
+    if (*pc == -1) {
+      i = strchr("dDsSwW", pc[1]) - "dDsSwW";
+      esc = t->esc[i];
+      if (!(t->hasesc >> i & 1)) {
+        memset(esc, 0, CLASSMAP * sizeof(int));
+        for (c = 0; c < 256; c++)
+          if (_classitem(pc, c, insensitive))
+            esc[c >> 5] |= 1u << (c & 31);
+        t->hasesc |= 1 << i;
+      }
+      for (c = 0; c < CLASSMAP; c++) map[c] |= esc[c];
+    } else if (insensitive) {
+      for (c = 0; c < 256; c++)
+        if (_classitem(pc, c, insensitive))
+          map[c >> 5] |= 1u << (c & 31);
+    } else {
+      for (c = *pc < 0 ? 0 : *pc; c <= pc[1] && c < 256; c++)
+        map[c >> 5] |= 1u << (c & 31);
+    }
+  }
+  if (!cls[CLASSMAP])
+    for (c = 0; c < CLASSMAP; c++) map[c] = ~map[c];
+}
+
+static int _grow(void **buf, int *cap, int need, int size)
+{
+  /* make room for need elements, doubling the buffer */
+  int n = *cap ? *cap : 64;
+  void *p;
+  if (need <= *cap) return 0;
+  while (n < need) n *= 2;
+  p = realloc(*buf, (size_t)n * size);
+  if (!p) return -1;
+  *buf = p;
+  *cap = n;
+  return 0;
+}
+
+static int _node(rtree *t, int op, int arg, int size)
+{
+  rnode *n;
+  if (_grow((void **)&t->nodes, &t->ncap, t->nnode + 1, sizeof(rnode))) return -1;
+  n = &t->nodes[t->nnode];
+  n->op = op;
+  n->arg = arg;
+  n->size = size;
+  n->child = n->next = -1;
+  n->min = n->max = 0;
+  return t->nnode++;
+}
+
+static int _item(rtree *t, rframe *f, int op, int arg, int size)
+{
+  /* append a new item to the current branch */
+  int n = _node(t, op, arg, size);
+  if (n < 0) return -1;
+  if (f->last < 0)
+    t->nodes[f->branch].child = n;
+  else
+    t->nodes[f->last].next = n;
+  f->last = n;
+  return n;
+}
+
+static int _quantify(rtree *t, rframe *f, int op, int lazy, int min, int max)
+{
+  /* the quantifier takes the place of the term, which moves to a new node */
+  long long s = 0, size;
+  int u = f->term, n = -1;
+  if (u >= 0) {
+    if ((n = _node(t, 0, 0, 0)) < 0) return -1;
+    t->nodes[n] = t->nodes[u];
+    s = t->nodes[n].size;
+  } else if ((u = _item(t, f, op, 0, 0)) < 0) {
+    return -1;
+  }
+  switch (op) {
+  case NQUEST: size = s + 2; break;
+  case NSTAR: size = s + 4; break;
+  case NPLUS: size = s + 2; break;
+  default:
+    if (min == 0)
+      size = max == 0 ? s + 2 : max < 0 ? s + 4 : 2 + s + (max - 1) * (s + 2);
+    else
+      size = min * s + (max < 0 ? 2 : max > min ? (max - min) * (s + 2) : 0);
+  }
+  if (size > MAXCODE) return -1;
+  t->nodes[u].op = op;
+  t->nodes[u].arg = lazy;
+  t->nodes[u].size = size;
+  t->nodes[u].child = n;
+  t->nodes[u].min = min;
+  t->nodes[u].max = max;
+  /* {n,m} with n > 0 can be quantified again as a whole */
+  f->term = op == NREPEAT && min > 0 ? u : -1;
+  return 0;
+}
+
+static int _catsize(rtree *t, int cat)
+{
+  int n, size = 0;
+  for (n = t->nodes[cat].child; n >= 0; n = t->nodes[n].next)
+    if ((size += t->nodes[n].size) > MAXCODE) return -1;
+  return t->nodes[cat].size = size;
+}
+
+static int _close(rtree *t, rframe *f)
+{
+  /* end the current branch, return the node of all the branches */
+  int n, size = _catsize(t, f->branch);
+  if (size < 0) return -1;
+  if (f->nbranch == 1) return f->branch;
+  size += f->size + 4 * (f->nbranch - 1);
+  if (size > MAXCODE || (n = _node(t, NALT, f->nbranch, size)) < 0) return -1;
+  t->nodes[n].child = f->first;
+  return n;
+}
+
+static int _class(rtree *t, int need)
+{
+  return _grow((void **)&t->cls, &t->ccap, t->clen + need, sizeof(int));
+}
+
+static int re_parse(rtree *t, const char *re, int utf8, int insensitive)
+{
+  rframe *fs = NULL, *f;
+  int nf = 0, fcap = 0, n, ch, res = -1;
+
+  if (_grow((void **)&fs, &fcap, 1, sizeof(rframe))) return -1;
+  f = &fs[nf++];
+  f->group = -1;
+  f->first = f->branch = _node(t, NCAT, 0, 0);
+  f->last = f->term = -1;
+  f->nbranch = 1;
+  f->size = 0;
+  if (f->branch < 0) goto _done;
 
   while (*re) {
+    f = &fs[nf - 1];
     switch (*re) {
     case '\\':
       re++;
-      if (!*re) return -1; /* Trailing backslash */
+      if (!*re) goto _done; /* Trailing backslash */
       switch (*re) {
       case '<': case '>': case 'B': case 'b':
-        EMIT(PC++, *re == '<' ? WBEG : (*re == '>' ? WEND : (*re == 'B' ? NOTB : WB)));
-        term = PC;
+        if (_item(t, f, *re == '<' ? WBEG : (*re == '>' ? WEND : (*re == 'B' ? NOTB : WB)), 0, 1) < 0)
+          goto _done;
+        f->term = -1;
         break;
       case 'd': case 'D': case 's': case 'S': case 'w': case 'W':
-        term = PC;
-        EMIT(PC++, CLASS);
-        EMIT(PC++, 1);
-        EMIT(PC++, 1);
-        EMIT(PC++, -1);
-        EMIT(PC++, *re);
-        break;
-      case 'n': case 'r': case 't': case 'f': case 'v':
-        term = PC;
-        switch (*re) {
-          case 'n': ch = '\n'; goto _char;
-          case 'r': ch = '\r'; goto _char;
-          case 't': ch = '\t'; goto _char;
-          case 'f': ch = '\f'; goto _char;
-          case 'v': ch = '\v'; goto _char;
-        }
+        if (_class(t, CLASSMAP + 4)) goto _done;
+        if ((f->term = _item(t, f, CLASS, t->clen, 2)) < 0) goto _done;
+        t->cls[t->clen + CLASSMAP] = 1;
+        t->cls[t->clen + CLASSMAP + 1] = 1;
+        t->cls[t->clen + CLASSMAP + 2] = -1;
+        t->cls[t->clen + CLASSMAP + 3] = *re;
+        re_classmap(t, t->cls + t->clen, insensitive);
+        t->clen += CLASSMAP + 4;
         break;
+      case 'n': ch = '\n'; goto _char;
+      case 'r': ch = '\r'; goto _char;
+      case 't': ch = '\t'; goto _char;
+      case 'f': ch = '\f'; goto _char;
+      case 'v': ch = '\v'; goto _char;
       case 'x': n = 2; goto _hex;
       case 'u': n = 4; goto _hex;
       case 'U': n = 8; _hex:
-        term = PC;
         ch = _code(re, n);
-        if (ch < 0) return -1;
+        if (ch < 0) goto _done;
         re += n;
         goto _char;
       default: goto _default;
@@ -259,102 +465,86 @@ static int _compilecode(const char *re_loc, rcode *prog, int sizecode, int utf8)
       break;
     default:
     _default:
-      term = PC;
       ch = uc_code(re, utf8);
     _char:
-      EMIT(PC++, CHAR);
-      EMIT(PC++, ch);
+      if ((f->term = _item(t, f, CHAR, ch, 2)) < 0) goto _done;
       break;
     case '.':
-      term = PC;
-      EMIT(PC++, ANY);
+      if ((f->term = _item(t, f, ANY, 0, 1)) < 0) goto _done;
       break;
     case '[':;
-      term = PC;
+      int at = t->clen + CLASSMAP, cnt = 0, tok, forward;
       re++;
-      EMIT(PC++, CLASS);
-      int neg = (*re == '^');
-      EMIT(PC++, !neg);
-      if (neg) re++;
-      PC++; /* Skip "# of pairs" byte */
-
-      int cnt = 0;
+      if (_class(t, CLASSMAP + 2)) goto _done;
+      if ((f->term = _item(t, f, CLASS, t->clen, 2)) < 0) goto _done;
+      t->cls[at++] = *re != '^';
+      if (*re == '^') re++;
+      at++; /* Skip "# of pairs" byte */
       while (*re != ']') {
-        int forward;
-        int tok = token(re, &forward, utf8);
-        if (tok == -1) return -1;
+        tok = token(re, &forward, utf8);
+        if (tok == -1) goto _done;
         re += forward;
-
+        if (_class(t, at - t->clen + 2)) goto _done;
         if (tok < 0) { // \d\D\s\S\w\W etc.
-          EMIT(PC++, -1);
-          EMIT(PC++, -tok);
+          t->cls[at++] = -1;
+          t->cls[at++] = -tok;
           cnt++;
           continue;
         }
-
-        EMIT(PC++, tok);
+        t->cls[at++] = tok;
         if (*re == '-' && re[1] != ']') {
           re++; // skip '-'
           tok = token(re, &forward, utf8);
-          if (tok < 0) return -1; // not alow \d\D\s\S\w\W here
+          if (tok < 0) goto _done; // not alow \d\D\s\S\w\W here
           re += forward;
         }
-        EMIT(PC++, tok);
+        t->cls[at++] = tok;
         cnt++;
       }
-      EMIT(term + 2, cnt);
+      t->cls[t->clen + CLASSMAP + 1] = cnt;
+      re_classmap(t, t->cls + t->clen, insensitive);
+      t->clen = at;
       break;
     case '(':;
-      term = PC;
-      int sub;
       int capture = 1;
       if (*(re+1) == '?') {
         re += 2;
         if (*re == ':')
           capture = 0;
         else
-          return -1;
+          goto _done;
       }
-      if (capture) {
-        sub = ++prog->sub;
-        EMIT(PC++, SAVE);
-        EMIT(PC++, sub);
-      }
-      cap_stack[capc++] = capture;
-      cap_stack[capc++] = term;
-      cap_stack[capc++] = alt_label;
-      cap_stack[capc++] = start;
-      cap_stack[capc++] = altc;
-      alt_label = 0;
-      start = PC;
+      if ((n = _node(t, NGROUP, capture ? ++t->nsub : 0, 0)) < 0) goto _done;
+      if (_grow((void **)&fs, &fcap, nf + 1, sizeof(rframe))) goto _done;
+      f = &fs[nf++];
+      f->group = n;
+      f->first = f->branch = _node(t, NCAT, 0, 0);
+      f->last = f->term = -1;
+      f->nbranch = 1;
+      f->size = 0;
+      if (f->branch < 0) goto _done;
       break;
     case ')':
-      if (--capc-4 < 0) return -1;
-      if (code && alt_label) {
-        EMIT(alt_label, REL(alt_label, PC) + 1);
-        int _altc = cap_stack[capc];
-        for (int alts = altc; altc > _altc; altc--) {
-          int at = alt_stack[_altc+alts-altc]+(altc-_altc)*2;
-          EMIT(at, REL(at, PC) + 1);
-        }
-      }
-      start = cap_stack[--capc];
-      alt_label = cap_stack[--capc];
-      term = cap_stack[--capc];
-      if (cap_stack[--capc]) {
-        EMIT(PC++, SAVE);
-        EMIT(PC++, code[term+1] + prog->presub + 1);
-      }
+      if (f->group < 0) goto _done;
+      if ((n = _close(t, f)) < 0) goto _done;
+      t->nodes[f->group].child = n;
+      t->nodes[f->group].size = t->nodes[n].size + (t->nodes[f->group].arg ? 4 : 0);
+      n = f->group;
+      f = &fs[--nf - 1];
+      if (f->last < 0)
+        t->nodes[f->branch].child = n;
+      else
+        t->nodes[f->last].next = n;
+      f->last = f->term = n;
       break;
     case '{':;
-      int maxcnt = 0, mincnt = 0, size = PC - term;
-      int split = SPLIT, rsplit = RSPLIT;
+      int maxcnt = 0, mincnt = 0;
       re++;
       // {n}, {n,}, or {n,m}
-      if (!isdigit((unsigned char) *re)) return -1;
+      if (!isdigit((unsigned char) *re)) goto _done;
       while (isdigit((unsigned char) *re)) {
         mincnt = mincnt * 10 + *re++ - '0';
-        if (mincnt > 65535) return -1;
+        if (mincnt > 65535) goto _done;
       }
       if (*re == '}') { // {n}
         maxcnt = mincnt;
@@ -365,132 +555,210 @@ static int _compilecode(const char *re_loc, rcode *prog, int sizecode, int utf8)
         } else if (isdigit((unsigned char) *re)) { // {n,m}
           while (isdigit((unsigned char) *re)) {
             maxcnt = maxcnt * 10 + *re++ - '0';
-            if (maxcnt > 65535) return -1;
+            if (maxcnt > 65535) goto _done;
           }
-          if (*re != '}') return -1;
+          if (*re != '}') goto _done;
         } else {
-          return -1;
+          goto _done;
         }
       } else {
-        return -1;
-      }
-      if (re[1] == '?') { // non-greedy
-        split = RSPLIT;
-        rsplit = SPLIT;
-        re++;
-      }
-      // {0}, {0,}, {0,2}
-      // {1}, {1,}, {1,3}
-      for (int i = 0; i < mincnt - 1; i++) {
-        if (code)
-          memcpy(&code[PC], &code[term], size*sizeof(int));
-        PC += size;
-      }
-      if (maxcnt < 0) {
-        EMIT(PC, rsplit);
-        EMIT(PC+1, REL(PC, PC - size));
-        PC += 2;
-      }
-      else if (maxcnt > 0) {
-        int diff = mincnt == 0 ? 1 : 0;
-        for (int i = maxcnt - mincnt - diff; i > 0; i--) {
-          EMIT(PC++, split);
-          EMIT(PC++, REL(PC, PC+((size+2)*i)));
-          if (code)
-            memcpy(&code[PC], &code[term], size*sizeof(int));
-          PC += size;
-        }
-      }
-      if (mincnt == 0) {
-        INSERT_CODE(term, 2, PC);
-        EMIT(term, maxcnt == 0 ? JMP : split);
-        EMIT(term + 1, REL(term, PC));
-        term = PC;
+        goto _done;
       }
+      n = re[1] == '?'; // non-greedy
+      if (n) re++;
+      if (_quantify(t, f, NREPEAT, n, mincnt, maxcnt)) goto _done;
       break;
-    case '?':
-      if (PC == term) return -1;
-      INSERT_CODE(term, 2, PC);
-      EMIT(term, re[1] == '?' ? RSPLIT : SPLIT);
-      if (re[1] == '?') re++;
-      EMIT(term + 1, REL(term, PC));
-      term = PC;
-      break;
-    case '*':
-      if (PC == term) return -1;
-      INSERT_CODE(term, 2, PC);
-      EMIT(PC, JMP);
-      EMIT(PC + 1, REL(PC, term));
-      PC += 2;
-      EMIT(term, re[1] == '?' ? RSPLIT : SPLIT);
-      if (re[1] == '?') re++;
-      EMIT(term + 1, REL(term, PC));
-      term = PC;
-      break;
-    case '+':
-      if (PC == term) return -1;
-      EMIT(PC, re[1] == '?' ? SPLIT : RSPLIT);
-      if (re[1] == '?') re++;
-      EMIT(PC + 1, REL(PC, term));
-      PC += 2;
-      term = PC;
+    case '?': case '*': case '+':
+      if (f->term < 0 || t->nodes[f->term].size == 0) goto _done;
+      n = re[1] == '?'; // non-greedy
+      if (_quantify(t, f, *re == '?' ? NQUEST : (*re == '*' ? NSTAR : NPLUS), n, 0, 0))
+        goto _done;
+      if (n) re++;
       break;
     case '|':
-      if (alt_label)
-        alt_stack[altc++] = alt_label;
-      INSERT_CODE(start, 2, PC);
-      EMIT(PC++, JMP);
-      alt_label = PC++;
-      EMIT(start, SPLIT);
-      EMIT(start + 1, REL(start, PC));
-      term = PC;
+      if ((n = _catsize(t, f->branch)) < 0 || (f->size += n) > MAXCODE) goto _done;
+      if ((n = _node(t, NCAT, 0, 0)) < 0) goto _done;
+      t->nodes[f->branch].next = n;
+      f->branch = n;
+      f->last = f->term = -1;
+      f->nbranch++;
       break;
     case '^': case '$':
-      EMIT(PC++, *re == '^' ? BOL : EOL);
-      term = PC;
+      if (_item(t, f, *re == '^' ? BOL : EOL, 0, 1) < 0) goto _done;
+      f->term = -1;
       break;
     }
-    c = uc_len(re, utf8); re += c;
+    ch = uc_len(re, utf8); re += ch;
   }
-  if (code && alt_label) {
-    EMIT(alt_label, REL(alt_label, PC) + 1);
-    for (int alts = altc; altc; altc--) {
-      int at = alt_stack[alts-altc]+altc*2;
-      EMIT(at, REL(at, PC) + 1);
-    }
-  }
-  return capc ? -1 : 0;
+  if (nf != 1) goto _done;
+  if ((t->root = _close(t, &fs[0])) < 0) goto _done;
+  res = 0;
+
+_done:
+  free(fs);
+  return res;
 }
 
-int re_sizecode(const char *re, int *nsub, int utf8)
+typedef struct rgen rgen;
+struct rgen
 {
-  rcode dummyprog;
-  dummyprog.unilen = 3;
-  dummyprog.sub = 0;
-
-  int res = _compilecode(re, &dummyprog, 1, utf8);
-  if (res < 0) return res;
-  *nsub = dummyprog.sub;
-  return dummyprog.unilen;
-}
+  int node;
+  int step;
+  int at;   /* start of its code */
+  int cur;  /* next child */
+};
 
-int re_comp(rcode *prog, const char *re, int nsubs, int utf8)
+static int re_comp(rcode *prog, rtree *t, int classes)
 {
+  /* generate the code of the tree into prog, then the class table */
+  int *code = prog->insts, pc = 0, sp = 0, i, s, b, at, split, rsplit;
+  rgen *st = malloc((t->nnode + 1) * sizeof(rgen)), *g;
+  rnode *nd;
+  if (!st) return -1;
+
   prog->len = 0;
-  prog->unilen = 0;
-  prog->sub = 0;
-  prog->presub = nsubs;
+  prog->sub = t->nsub;
+  prog->presub = t->nsub;
   prog->splits = 0;
+  prog->classes = classes;
+  prog->clen = t->clen;
+
+#define GEN(n) (st[sp].node = (n), st[sp].step = 0, st[sp].at = pc, sp++)
+  GEN(t->root);
+  while (sp) {
+    g = &st[sp - 1];
+    nd = &t->nodes[g->node];
+    split = nd->arg ? RSPLIT : SPLIT;
+    rsplit = nd->arg ? SPLIT : RSPLIT;
+    switch (nd->op) {
+    case CHAR:
+      code[pc++] = CHAR;
+      code[pc++] = nd->arg;
+      sp--;
+      break;
+    case CLASS:
+      code[pc++] = CLASS;
+      code[pc++] = classes + nd->arg;
+      sp--;
+      break;
+    case NCAT:
+      if (g->step++ == 0) g->cur = nd->child;
+      if (g->cur < 0) { sp--; break; }
+      i = g->cur;
+      g->cur = t->nodes[i].next;
+      GEN(i);
+      break;
+    case NALT:
+      if (g->step++ == 0) {
+        /* a split to each branch but the first, the last branch first */
+        at = g->at + 2 * (nd->arg - 1);
+        for (b = 1, i = nd->child; b < nd->arg; b++) {
+          at += t->nodes[i].size + 2;
+          i = t->nodes[i].next;
+          s = g->at + 2 * (nd->arg - 1 - b);
+          code[s] = SPLIT;
+          code[s + 1] = at - s - 2;
+        }
+        pc = g->at + 2 * (nd->arg - 1);
+        g->cur = nd->child;
+        GEN(g->cur);
+        break;
+      }
+      if ((g->cur = t->nodes[g->cur].next) < 0) { sp--; break; }
+      /* the branch before jumps to the end */
+      code[pc] = JMP;
+      code[pc + 1] = g->at + nd->size - pc - 2;
+      pc += 2;
+      GEN(g->cur);
+      break;
+    case NGROUP:
+      if (g->step++ == 0) {
+        if (nd->arg) {
+          code[pc++] = SAVE;
+          code[pc++] = nd->arg;
+        }
+        GEN(nd->child);
+        break;
+      }
+      if (nd->arg) {
+        code[pc++] = SAVE;
+        code[pc++] = nd->arg + prog->presub + 1;
+      }
+      sp--;
+      break;
+    case NQUEST:
+    case NSTAR:
+      if (g->step++ == 0) {
+        s = t->nodes[nd->child].size;
+        code[pc++] = split;
+        code[pc++] = nd->op == NSTAR ? s + 2 : s;
+        GEN(nd->child);
+        break;
+      }
+      if (nd->op == NSTAR) {
+        code[pc] = JMP;
+        code[pc + 1] = g->at - pc - 2;
+        pc += 2;
+      }
+      sp--;
+      break;
+    case NPLUS:
+      if (g->step++ == 0) {
+        GEN(nd->child);
+        break;
+      }
+      code[pc] = rsplit;
+      code[pc + 1] = g->at - pc - 2;
+      pc += 2;
+      sp--;
+      break;
+    case NREPEAT:
+      if (g->step++ == 0) {
+        if (nd->min == 0) {
+          code[pc++] = nd->max == 0 ? JMP : split;
+          code[pc++] = nd->size - 2;
+        }
+        g->cur = pc;
+        if (nd->child >= 0) {
+          GEN(nd->child);
+          break;
+        }
+      }
+      /* the item is generated once, the copies are taken from it */
+      at = g->cur;
+      s = pc - at;
+      for (i = 1; i < nd->min; i++) {
+        memcpy(&code[pc], &code[at], s * sizeof(int));
+        pc += s;
+      }
+      if (nd->max < 0) {
+        code[pc] = rsplit;
+        code[pc + 1] = -s - 2;
+        pc += 2;
+      } else {
+        for (i = nd->max - (nd->min ? nd->min : 1); i > 0; i--) {
+          code[pc] = split;
+          code[pc + 1] = (s + 2) * i - 2;
+          pc += 2;
+          memcpy(&code[pc], &code[at], s * sizeof(int));
+          pc += s;
+        }
+      }
+      sp--;
+      break;
+    default:
+      code[pc++] = nd->op;
+      sp--;
+    }
+  }
+#undef GEN
+  free(st);
+  prog->unilen = pc;
+  if (t->clen) memcpy(code + classes, t->cls, t->clen * sizeof(int));
 
-  int res = _compilecode(re, prog, 0, utf8);
-  if (res < 0) return res;
   int icnt = 0, scnt = SPLIT;
   for (int i = 0; i < prog->unilen; i++)
     switch (prog->insts[i]) {
-    case CLASS:
-      i += prog->insts[i+2] * 2 + 2;
-      icnt++;
-      break;
     case SPLIT:
       prog->insts[i++] = scnt;
       scnt += 2;
@@ -502,6 +770,7 @@ int re_comp(rcode *prog, const char *re, int nsubs, int utf8)
     case JMP:
     case SAVE:
     case CHAR:
+    case CLASS:
       i++;
     case ANY:
       icnt++;
@@ -511,12 +780,252 @@ int re_comp(rcode *prog, const char *re, int nsubs, int utf8)
   prog->insts[prog->unilen++] = MATCH;
   prog->splits = (scnt - SPLIT) / 2;
   prog->len = icnt + 2;
-  prog->presub = sizeof(rsub)+(sizeof(char*) * (nsubs + 1) * 2);
+  prog->presub = sizeof(rsub)+(sizeof(char*) * (t->nsub + 1) * 2);
+  /* every thread may hold its own captures, the VM could not run it */
+  if ((long long)prog->presub * (prog->len - prog->splits + 3) > MAXSUB)
+    return -1;
   prog->sub = prog->presub * (prog->len - prog->splits + 3);
   prog->sparsesz = scnt;
   return 0;
 }
 
+static int _inslen(const int *pc)
+{
+  switch (*pc) {
+  case CHAR: case CLASS: case SAVE: case JMP: return 2;
+  case ANY: case MATCH: case WBEG: case WEND: case WB: case NOTB: case BOL: case EOL:
+    return 1;
+  }
+  return 2; /* SPLIT and RSPLIT */
+}
+
+static void _opbytes(const int *insts, const int *pc, int insensitive, unsigned int *set)
+{
+  /* add the bytes taken by a consuming instruction to the 256-bit set */
+  int c, i;
+  switch (*pc) {
+  case CLASS:
+    for (i = 0; i < CLASSMAP; i++) set[i] |= insts[pc[1] + i];
+    break;
+  case CHAR:
+    if ((c = pc[1]) < 0 || c > 255) break;
+    set[c >> 5] |= 1u << (c & 31);
+    if (insensitive) {
+      set[tolower(c) >> 5] |= 1u << (tolower(c) & 31);
+      set[toupper(c) >> 5] |= 1u << (toupper(c) & 31);
+    }
+    break;
+  default: /* ANY */
+    memset(set, 0xff, CLASSMAP * sizeof(int));
+  }
+}
+
+/*
+  Run skipping for greedy loops over one consuming instruction, such as
+  [^"]*, .* or \s+. While the first thread of clist sits on such a loop,
+  a byte that the loop takes and that the other threads, the exits of the
+  loop and the new threads all reject only leads to an equivalent thread
+  list: the loop thread comes back with the same sub, everything else
+  dies. So the VM jumps over the run and resumes on its last byte. The
+  runs are precomputed as byte sets (ASCII only in utf8 mode).
+  Like racm, the block holds offsets only.
+*/
+#define SKIP_MAXCLOSURE 64
+#define SKIPHAS(set, c) ((set).w[(c) >> 5] >> ((c) & 31) & 1)
+
+typedef struct rskipset rskipset;
+struct rskipset
+{
+  unsigned int w[8];
+};
+
+typedef struct rskipent rskipent;
+struct rskipent
+{
+  rskipset acc; /* bytes the instruction takes */
+  int loop;     /* index of the loop, -1 = none */
+};
+
+typedef struct rskiploop rskiploop;
+struct rskiploop
+{
+  rskipset run;    /* run while no new threads are added */
+  rskipset runinj; /* run while new threads are added */
+  int inj;         /* the new threads allow runinj */
+};
+
+typedef struct rskip rskip;
+struct rskip
+{
+  int size;   /* size of the whole block */
+  int ents;   /* offset of the entries in data */
+  int loops;  /* offset of the loops in data */
+  int data[]; /* entry of each pc (-1 = none), then the above */
+};
+
+static int _skclosure(const int *insts, int pc, int *mark, int gen, int *stack,
+  const int *ent, const rskipent *ents, rskipset *acc, int *first)
+{
+  /* walk the threads from pc in the order of addthread, inside the input
+     (BOL and EOL fail). or the bytes of the consuming instructions into
+     acc, but the first one reached goes to *first instead (-1 if a SAVE
+     or MATCH comes before it). return 1 if MATCH is reached, -1 on word
+     assertions or long walks */
+  int si = 0, n = 0, matched = 0, save = 0, op, w;
+  for (;;) {
+    if (++n > SKIP_MAXCLOSURE) return -1;
+    op = insts[pc];
+    if (op == SAVE) {
+      save = 1;
+      pc += 2;
+      continue;
+    } else if (op == JMP) {
+      pc += 2 + insts[pc+1];
+      continue;
+    } else if (op > JMP || op < 0) {
+      if (mark[pc] != gen) {
+        mark[pc] = gen;
+        stack[si++] = op > JMP ? pc + 2 + insts[pc+1] : pc + 2;
+        pc = op > JMP ? pc + 2 : pc + 2 + insts[pc+1];
+        continue;
+      }
+    } else if (op == MATCH) {
+      matched = 1;
+      if (first && *first == -2) *first = -1;
+    } else if (op == CHAR || op == CLASS || op == ANY) {
+      if (first && *first == -2)
+        *first = save ? -1 : pc;
+      else
+        for (w = 0; w < 8; w++) acc->w[w] |= ents[ent[pc]].acc.w[w];
+    } else if (op != BOL && op != EOL) {
+      return -1;
+    }
+    if (!si) return matched;
+    pc = stack[--si];
+  }
+}
+
+static rskip *re_skipcomp(rcode *prog, int insensitive, int utf8)
+{
+  int *insts = prog->insts, *ent, *mark, *stack;
+  int nent = 0, nloop = 0, gen = 0, pc, w, m, first, size, any;
+  rskipent *ents = NULL, *e;
+  rskiploop *loops = NULL, *l;
+  rskipset exits, starts;
+  rskip *sk = NULL;
+
+  /* a loop needs a jump back, most patterns have none */
+  for (pc = 0; pc < prog->unilen; pc += _inslen(&insts[pc])) {
+    m = insts[pc];
+    if ((m == JMP || m > JMP || m < 0) && insts[pc+1] < 0) break;
+  }
+  if (pc >= prog->unilen) return NULL;
+
+  ent = malloc(prog->unilen * sizeof(int));
+  mark = calloc(prog->unilen, sizeof(int));
+  stack = malloc(prog->unilen * sizeof(int));
+  if (!ent || !mark || !stack) goto _done;
+  for (pc = 0; pc < prog->unilen; pc += _inslen(&insts[pc])) {
+    ent[pc] = -1;
+    if (insts[pc] == CHAR || insts[pc] == CLASS || insts[pc] == ANY)
+      ent[pc] = nent++;
+  }
+  ents = calloc(nent + 1, sizeof(rskipent));
+  loops = calloc(nent + 1, sizeof(rskiploop));
+  if (!ents || !loops) goto _done;
+  for (pc = 0; pc < prog->unilen; pc += _inslen(&insts[pc])) {
+    if (ent[pc] < 0) continue;
+    e = &ents[ent[pc]];
+    e->loop = -1;
+    _opbytes(insts, &insts[pc], insensitive, e->acc.w);
+    if (utf8) memset(e->acc.w + 4, 0, sizeof(e->acc.w) / 2);
+  }
+
+  for (pc = 0; pc < prog->unilen; pc += _inslen(&insts[pc])) {
+    if (ent[pc] < 0) continue;
+    /* a loop thread comes back to pc first, with nothing saved */
+    m = insts[pc + _inslen(&insts[pc])];
+    if (m == CHAR || m == CLASS || m == ANY || m == SAVE || m == MATCH) continue;
+    first = -2;
+    memset(&exits, 0, sizeof(exits));
+    m = _skclosure(insts, pc + _inslen(&insts[pc]), mark, ++gen, stack, ent, ents, &exits, &first);
+    if (m != 0 || first != pc) continue;
+    l = &loops[nloop];
+    for (w = any = 0; w < 8; w++)
+      any |= l->run.w[w] = ents[ent[pc]].acc.w[w] & ~exits.w[w];
+    if (!any) continue;
+    /* new threads follow the loop thread, its splits are already taken */
+    memset(&starts, 0, sizeof(starts));
+    m = _skclosure(insts, 0, mark, gen, stack, ent, ents, &starts, NULL);
+    for (w = any = 0; w < 8; w++)
+      any |= l->runinj.w[w] = l->run.w[w] & ~starts.w[w];
+    l->inj = m == 0 && any;
+    ents[ent[pc]].loop = nloop++;
+  }
+  if (!nloop) goto _done;
+
+  size = sizeof(rskip) + prog->unilen * sizeof(int) + nent * sizeof(rskipent) + nloop * sizeof(rskiploop);
+  sk = malloc(size);
+  if (!sk) goto _done;
+  sk->size = size;
+  sk->ents = prog->unilen;
+  sk->loops = sk->ents + nent * sizeof(rskipent) / sizeof(int);
+  memcpy(sk->data, ent, prog->unilen * sizeof(int));
+  memcpy(sk->data + sk->ents, ents, nent * sizeof(rskipent));
+  memcpy(sk->data + sk->loops, loops, nloop * sizeof(rskiploop));
+
+_done:
+  free(ent); free(mark); free(stack); free(ents); free(loops);
+  return sk;
+}
+
+static inline const char *re_skiprun(rskip *sk, int *insts, rthread *clist, int n, const int *mcont, const char *sp, const char *end)
+{
+  /* return the last byte of the run of the loop thread at clist[0], or
+     sp if there is nothing to skip. mcont is the pc the VM leaves behind
+     a recorded match */
+  const rskipent *ents = (const rskipent *)(sk->data + sk->ents), *e;
+  const rskiploop *l;
+  const unsigned char *p = (const unsigned char *)sp, *pend = (const unsigned char *)end, *q;
+  unsigned int x;
+  rskipset run;
+  int i, j, w, inj = 1, k = sk->data[clist[0].pc - insts];
+
+  if (k < 0 || ents[k].loop < 0 || pend - p < 2) return sp;
+  l = (const rskiploop *)(sk->data + sk->loops) + ents[k].loop;
+  if (!SKIPHAS(l->run, p[0]) || !SKIPHAS(l->run, p[1])) return sp;
+  /* MATCH cuts the threads behind it and stops adding new ones */
+  for (i = 1; i < n && *clist[i].pc != MATCH; i++);
+  /* a thread about to match is recorded on the next byte, not replayed */
+  if (i < n && clist[i].pc != mcont) return sp;
+  if (i < n) inj = 0;
+  else if (!l->inj) return sp;
+  run = inj ? l->runinj : l->run;
+  if (!SKIPHAS(run, p[0]) || !SKIPHAS(run, p[1])) return sp;
+  for (j = 1; j < i; j++) {
+    e = &ents[sk->data[clist[j].pc - insts]];
+    for (w = 0; w < 8; w++) run.w[w] &= ~e->acc.w[w];
+  }
+  if (!SKIPHAS(run, p[0]) || !SKIPHAS(run, p[1])) return sp;
+
+  /* the bytes that end the run, a single one is found by memchr */
+  for (w = 0, k = -1; w < 8; w++) {
+    if (!(x = ~run.w[w])) continue;
+    if (k != -1 || (x & (x - 1))) { k = -2; break; }
+    for (k = w * 32; !(x & 1); x >>= 1) k++;
+  }
+  if (k == -1) {
+    p = pend;
+  } else if (k >= 0) {
+    q = memchr(p, k, pend - p);
+    p = q ? q : pend;
+  } else {
+    p += 2;
+    while (p < pend && SKIPHAS(run, *p)) p++;
+  }
+  return (const char *)p - 1;
+}
+
 #define newsub(init, copy) \
 if (freesub) \
   { s1 = freesub; freesub = s1->freesub; copy } \
@@ -598,51 +1107,52 @@ if ((unsigned int)spc < WBEG) { \
   continue; \
 } \
 next##nn: \
-if (spc > JMP) { \
+switch (spc > JMP ? SPLIT : spc < 0 ? RSPLIT : spc) { \
+case SPLIT: \
   onlist(nn) \
   npc += 2; \
   pcs[si] = npc + npc[-1]; \
   fastrec(nn, list, listidx) \
-} else if (spc == SAVE) { \
+case SAVE: \
   save##list() \
   nsub->sub[npc[1]] = _sp; \
   npc += 2; \
   goto rec##nn; \
-} else if (spc == NOTB) { \
+case NOTB: \
   if ((sp == s && _sp == s && \
     (cont ? isword(cont) != isword(sp) : isword(sp))) || \
     isword(_sp) != isword(sp)) \
     deccheck(nn) \
   npc++; goto rec##nn; \
-} else if (spc == WB) { \
+case WB: \
   if (!((sp == s && _sp == s && \
     (cont ? isword(cont) != isword(sp) : isword(sp))) || \
     isword(_sp) != isword(sp))) \
     deccheck(nn) \
   npc++; goto rec##nn; \
-} else if (spc == WBEG) { \
+case WBEG: \
   if (((sp != s || sp != _sp) && isword(sp)) || !isword(_sp)) \
     deccheck(nn) \
   npc++; goto rec##nn; \
-} else if (spc < 0) { \
+case RSPLIT: \
   spc = -spc; \
   onlist(nn) \
   npc += 2; \
   pcs[si] = npc; \
   npc += npc[-1]; \
   fastrec(nn, list, listidx) \
-} else if (spc == WEND) { \
+case WEND: \
   if (!isword(sp) || isword(_sp)) \
     deccheck(nn) \
   npc++; goto rec##nn; \
-} else if (spc == EOL) { \
+case EOL: \
   if (!last) \
     deccheck(nn) \
   npc++; goto rec##nn; \
-} else if (spc == JMP) { \
+case JMP: \
   npc += 2 + npc[1]; \
   goto rec##nn; \
-} else { \
+default: /* BOL */ \
   if (_sp != s) { \
     if (!si && !clistidx) \
       return 0; \
@@ -659,7 +1169,17 @@ clistidx = nlistidx; \
 
 #define deccont() { decref(nsub) continue; }
 
-int re_pikevm(rcode *prog, const char *s, int len, const char **subp, int nsubp, int insensitive, int utf8, const char* cont)
+#define VMSTACK 65536 /* largest scratch of re_pikevm kept on the stack, in bytes */
+
+static size_t re_vmsize(rcode *prog)
+{
+  /* pcs, subs, both thread lists, the rsub arena and sdense, in this order */
+  return prog->splits * (sizeof(int*) + sizeof(rsub*)) +
+    prog->len * 2 * sizeof(rthread) + prog->sub +
+    prog->sparsesz * sizeof(unsigned int);
+}
+
+int re_pikevm(rcode *prog, const char *s, int len, const char **subp, int nsubp, int insensitive, int utf8, const char* cont, rskip *skip, void *scratch)
 {
   int rsubsize = prog->presub, suboff = 0;
   int spc, i, j, c, *npc, osubp = nsubp * sizeof(char*);
@@ -667,13 +1187,12 @@ int re_pikevm(rcode *prog, const char *s, int len, const char **subp, int nsubp,
   const char *sp = s, *_sp = s;
   int last = 0;
   int *insts = prog->insts;
-  int *pcs[prog->splits];
-  rsub *subs[prog->splits];
-  unsigned int sdense[prog->sparsesz], sparsesz = 0;
+  int **pcs = scratch;
+  rsub **subs = (rsub**)(pcs + prog->splits);
+  rthread *clist = (rthread*)(subs + prog->splits), *nlist = clist + prog->len, *tmp;
+  char *nsubs = (char*)(nlist + prog->len);
+  unsigned int *sdense = (unsigned int*)(nsubs + prog->sub), sparsesz = 0;
   rsub *nsub, *s1, *matched = NULL, *freesub = NULL;
-  rthread _clist[prog->len], _nlist[prog->len];
-  rthread *clist = _clist, *nlist = _nlist, *tmp;
-  char nsubs[prog->sub];
   if (len == 0) last = 1;
   goto jmp_start;
   for (;; sp = _sp) {
@@ -681,6 +1200,8 @@ int re_pikevm(rcode *prog, const char *s, int len, const char **subp, int nsubp,
       i = 0;
       c = 0;
     } else {
+      if (skip && clistidx)
+        sp = re_skiprun(skip, insts, clist, clistidx, &mcont, sp, s + len);
       i = uc_len(sp, utf8);
       c = uc_code(sp, utf8);
     }
@@ -699,9 +1220,9 @@ int re_pikevm(rcode *prog, const char *s, int len, const char **subp, int nsubp,
         }
         npc += 2;
       } else if (spc == CLASS) {
-        if (!re_classmatch(npc+1, c, insensitive))
+        if (!re_class(insts + npc[1], c, insensitive))
           deccont()
-        npc += *(npc+2) * 2 + 3;
+        npc += 2;
       } else if (spc == MATCH) {
         matched:
         nlist[nlistidx++].pc = &mcont;
@@ -737,10 +1258,718 @@ int re_pikevm(rcode *prog, const char *s, int len, const char **subp, int nsubp,
   return 0;
 }
 
+/*
+  Aho-Corasick automaton for patterns that are nothing but an alternation
+  of literals, e.g. "foo|bar|baz", "(?:foo|bar)" or "(foo|bar)". A group
+  may also be surrounded by assertions, e.g. "\\b(?:foo|bar)\\b", which
+  are checked at both ends of each literal found. Such patterns are never
+  compiled to rcode, so the size of the alternation does not matter to
+  the compiler nor to the VM.
+  The trie keeps its children as sibling lists, only the root has a full
+  goto table. Nodes are indexed (not pointed), so the block can be copied.
+*/
+typedef struct racnode racnode;
+struct racnode
+{
+  int child; /* first child, 0 = none */
+  int next;  /* next sibling, 0 = none */
+  int fail;  /* failure link */
+  int out;   /* longest node on the fail chain ending a literal, 0 = none */
+  int alt;   /* first alternative ending here, -1 = none */
+  int depth; /* length in bytes */
+  int ch;    /* byte leading here */
+};
+
+typedef struct racm racm;
+struct racm
+{
+  int size;  /* size of the whole block */
+  int len;   /* number of nodes */
+  int insensitive;
+  int pre;   /* assertions before the group, 1 << op */
+  int post;  /* assertions after the group, 1 << op */
+  int root[256];  /* goto function of the root */
+  racnode nodes[];
+};
+
+static int uc_encode(unsigned char *dst, int cp, int utf8)
+{
+  /* inverse of uc_code, return 0 for a codepoint we cannot emit */
+  if (!utf8 || cp < 0x80) {
+    if (cp > 255) return 0;
+    dst[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    dst[0] = 0xc0 | (cp >> 6);
+    dst[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    dst[0] = 0xe0 | (cp >> 12);
+    dst[1] = 0x80 | ((cp >> 6) & 0x3f);
+    dst[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  } else if (cp < 0x200000) {
+    dst[0] = 0xf0 | (cp >> 18);
+    dst[1] = 0x80 | ((cp >> 12) & 0x3f);
+    dst[2] = 0x80 | ((cp >> 6) & 0x3f);
+    dst[3] = 0x80 | (cp & 0x3f);
+    return 4;
+  }
+  return 0;
+}
+
+static int _aclit(const char *re, int *cp, int utf8)
+{
+  /* return the length of the literal at re, 0 if it is not a literal */
+  int n, i;
+  switch (*re) {
+  case 0: case '.': case '[': case '(': case ')': case '{':
+  case '?': case '*': case '+': case '|': case '^': case '$':
+    return 0;
+  case '\\':
+    re++;
+    switch (*re) {
+    case 0: case '<': case '>': case 'b': case 'B':
+    case 'd': case 'D': case 's': case 'S': case 'w': case 'W':
+      return 0;
+    case 'n': *cp = '\n'; return 2;
+    case 'r': *cp = '\r'; return 2;
+    case 't': *cp = '\t'; return 2;
+    case 'f': *cp = '\f'; return 2;
+    case 'v': *cp = '\v'; return 2;
+    case 'x': n = 2; goto _hex;
+    case 'u': n = 4; goto _hex;
+    case 'U': n = 8; _hex:
+      *cp = _code(re, n);
+      return *cp < 0 ? 0 : n + 2;
+    }
+    n = 1;
+    break;
+  default:
+    n = 0;
+  }
+  for (i = 1; i < uc_len(re, utf8); i++)
+    if (!re[i]) return 0; /* Truncated utf-8 character */
+  *cp = uc_code(re, utf8);
+  return n + uc_len(re, utf8);
+}
+
+static int _acassert(const char *re, int *op)
+{
+  /* return the length of the assertion at re, 0 if it is not one */
+  switch (*re) {
+  case '^': *op = BOL; return 1;
+  case '$': *op = EOL; return 1;
+  case '\\':
+    switch (re[1]) {
+    case 'b': *op = WB; return 2;
+    case 'B': *op = NOTB; return 2;
+    case '<': *op = WBEG; return 2;
+    case '>': *op = WEND; return 2;
+    }
+  }
+  return 0;
+}
+
+static racm *re_accomp(const char *re, int insensitive, int utf8, int *nsub)
+{
+  racm *ac = NULL, *tmp;
+  racnode *nd;
+  unsigned char buf[4];
+  const char *p;
+  int pass, cap = 64, wrapped = 0, alt, len, node, n, m, cp, c, i;
+  int pre = 0, post = 0, op;
+  int *queue, qhead, qtail;
+
+  *nsub = 0;
+  /* $ before or ^ after a literal never holds, leave it to the VM */
+  while ((n = _acassert(re, &op)) && op != EOL) {
+    pre |= 1 << op;
+    re += n;
+  }
+  if (pre && *re != '(') return NULL;
+  if (*re == '(') {
+    wrapped = 1;
+    if (re[1] != '?') {
+      *nsub = 1;
+      re++;
+    } else if (re[2] == ':') {
+      re += 3;
+    } else {
+      return NULL;
+    }
+  }
+  /* the first pass only checks, the second pass builds the trie */
+  for (pass = 0; pass < 2; pass++) {
+    if (pass) {
+      ac = malloc(sizeof(racm) + cap * sizeof(racnode));
+      if (!ac) return NULL;
+      memset(ac, 0, sizeof(racm) + sizeof(racnode));
+      ac->nodes[0].alt = -1;
+      ac->len = 1;
+      ac->insensitive = insensitive;
+      ac->pre = pre;
+      ac->post = post;
+    }
+    p = re; alt = 0; len = 0; node = 0;
+    for (;;) {
+      if (*p == '|' || !*p || (wrapped && *p == ')')) {
+        if (!len) goto _fail; /* Empty alternative */
+        if (pass && ac->nodes[node].alt < 0)
+          ac->nodes[node].alt = alt;
+        if (*p != '|') break;
+        p++; alt++; len = 0; node = 0;
+        continue;
+      }
+      n = _aclit(p, &cp, utf8);
+      if (!n) goto _fail;
+      m = uc_encode(buf, cp, utf8);
+      if (!m) goto _fail;
+      p += n;
+      len += m;
+      if (!pass) continue;
+      for (i = 0; i < m; i++) {
+        c = buf[i];
+        if (insensitive && c < 128) c = tolower(c);
+        nd = ac->nodes;
+        for (n = nd[node].child; n && nd[n].ch != c; n = nd[n].next);
+        if (!n) {
+          if (ac->len == cap) {
+            cap *= 2;
+            tmp = realloc(ac, sizeof(racm) + cap * sizeof(racnode));
+            if (!tmp) goto _fail;
+            ac = tmp;
+            nd = ac->nodes;
+          }
+          n = ac->len++;
+          memset(&nd[n], 0, sizeof(racnode));
+          nd[n].alt = -1;
+          nd[n].ch = c;
+          nd[n].depth = nd[node].depth + 1;
+          nd[n].next = nd[node].child;
+          nd[node].child = n;
+          if (!node) ac->root[c] = n;
+        }
+        node = n;
+      }
+    }
+    if (wrapped) {
+      if (*p++ != ')') goto _fail;
+      for (post = 0; (n = _acassert(p, &op)) && op != BOL; p += n)
+        post |= 1 << op;
+    }
+    if (*p) goto _fail;
+    if (!alt) goto _fail; /* Not an alternation */
+  }
+
+  /* breadth-first, so that the failure links of shallower nodes are ready */
+  nd = ac->nodes;
+  queue = malloc(ac->len * sizeof(int));
+  if (!queue) goto _fail;
+  qhead = qtail = 0;
+  queue[qtail++] = 0;
+  while (qhead < qtail) {
+    node = queue[qhead++];
+    for (n = nd[node].child; n; n = nd[n].next) {
+      queue[qtail++] = n;
+      c = nd[n].ch;
+      m = 0;
+      if (node) {
+        for (i = nd[node].fail; i; i = nd[i].fail) {
+          for (m = nd[i].child; m && nd[m].ch != c; m = nd[m].next);
+          if (m) break;
+        }
+        if (!i) m = ac->root[c];
+      }
+      nd[n].fail = m;
+      nd[n].out = nd[n].alt >= 0 ? n : nd[m].out;
+    }
+  }
+  free(queue);
+  ac->size = sizeof(racm) + ac->len * sizeof(racnode);
+  tmp = realloc(ac, ac->size);
+  return tmp ? tmp : ac;
+
+_fail:
+  free(ac);
+  return NULL;
+}
+
+static int _acholds(int asserts, const char *s, const char *p, int len, const char *cont)
+{
+  /* check the assertions at p the same way as addthread */
+  int wb = p == s ? (cont ? isword(cont) != isword(p) : isword(p)) :
+    isword(p - 1) != isword(p);
+  if ((asserts >> BOL & 1) && p != s) return 0;
+  if ((asserts >> EOL & 1) && p < s + len) return 0;
+  if ((asserts >> WB & 1) && !wb) return 0;
+  if ((asserts >> NOTB & 1) && wb) return 0;
+  if ((asserts >> WBEG & 1) && (!isword(p) || (p != s && isword(p - 1)))) return 0;
+  if ((asserts >> WEND & 1) && (p == s || !isword(p - 1) || isword(p))) return 0;
+  return 1;
+}
+
+static int re_acmatch(racm *ac, const char *s, int len, const char **subp, int nsubp, const char *cont)
+{
+  /* leftmost-first: the earliest start wins, then the first alternative */
+  racnode *nd = ac->nodes;
+  int i, c, n, t, beg, node = 0, from = -1, to = 0, alt = 0;
+  for (i = 0; i < len; i++) {
+    c = (unsigned char) s[i];
+    if (ac->insensitive && c < 128) c = tolower(c);
+    for (n = 0; node; node = nd[node].fail) {
+      for (n = nd[node].child; n && nd[n].ch != c; n = nd[n].next);
+      if (n) break;
+    }
+    node = node ? n : ac->root[c];
+    /* the literals ending here, longest first, until one qualifies */
+    for (t = nd[node].out; t; t = nd[nd[t].fail].out) {
+      beg = i + 1 - nd[t].depth;
+      if (from >= 0 && (beg > from || (beg == from && nd[t].alt >= alt))) break;
+      if (ac->pre && !_acholds(ac->pre, s, s + beg, len, cont)) continue;
+      if (ac->post && !_acholds(ac->post, s, s + i + 1, len, cont)) continue;
+      from = beg;
+      to = i + 1;
+      alt = nd[t].alt;
+      break;
+    }
+    /* no literal alive in the trie can start early enough any more */
+    if (from >= 0 && i + 1 - nd[node].depth > from) break;
+  }
+  if (from < 0) return 0;
+  for (i = 0; i < nsubp; i += 2) {
+    subp[i] = s + from;
+    subp[i+1] = s + to;
+  }
+  return 1;
+}
+
+/*
+  One-pass DFA for anchored patterns (beginning with ^) in binary mode.
+  A program is one-pass if, at every position, the next byte selects at
+  most one thread. Each state then stands for the closure after one
+  consuming instruction, and every transition carries the saves on its
+  path, so captures are recorded directly without thread lists and rsub.
+  Like racm, the block holds offsets only.
+*/
+#define ONEPASS_MAXSTATE 256
+
+typedef struct ronstate ronstate;
+struct ronstate
+{
+  int match;    /* saves before MATCH in the middle, -1 = no match */
+  int endmatch; /* saves before MATCH at the end of input, -1 = no match */
+};
+
+typedef struct ronepass ronepass;
+struct ronepass
+{
+  int size;   /* size of the whole block */
+  int nstate;
+  int nslot;  /* number of sub slots */
+  int map;    /* offset of the transitions (int[nstate][256]) in data */
+  int acts;   /* offset of the saves in data, acts[i] is the count */
+  int data[]; /* ronstate[nstate], then the above */
+};
+
+/* a transition is the saves on its path and the next state + 1, 0 = none */
+#define OPNEXT(t) (((t) & 511) - 1)
+#define OPACTS(t) ((t) >> 9)
+
+typedef struct ronbuild ronbuild;
+struct ronbuild
+{
+  int *insts;
+  int *mark, gen; /* splits visited by the current closure */
+  int *stack;     /* pending pc and path length */
+  int *path;      /* saves on the current path */
+  int *epc, *eact, nent; /* entries of the closure */
+  int *acts, nact, capact;
+};
+
+static int _opsaves(ronbuild *b, int npath)
+{
+  /* append the saves on the path to acts, return its index (0 = none) */
+  int *tmp, at = b->nact;
+  if (!npath) return 0;
+  if (b->nact + npath + 1 > b->capact) {
+    b->capact = (b->nact + npath + 1) * 2;
+    tmp = realloc(b->acts, b->capact * sizeof(int));
+    if (!tmp) return -1;
+    b->acts = tmp;
+  }
+  b->acts[b->nact++] = npath;
+  memcpy(&b->acts[b->nact], b->path, npath * sizeof(int));
+  b->nact += npath;
+  return at;
+}
+
+static int _opclosure(ronbuild *b, int pc, int start, int end)
+{
+  /* follow the threads from pc in the same order as addthread, stop at
+     MATCH since it cuts the lower priority threads. return -1 if the
+     closure cannot be expressed (word assertions) */
+  int *insts = b->insts, si = 0, npath = 0, op, id;
+  b->gen++;
+  b->nent = 0;
+  for (;;) {
+    op = insts[pc];
+    if ((unsigned int)op < WBEG) {
+      if (op == MATCH || !end) {
+        b->epc[b->nent] = pc;
+        b->eact[b->nent] = _opsaves(b, npath);
+        if (b->eact[b->nent++] < 0) return -1;
+        if (op == MATCH) return 0;
+      }
+    } else if (op == SAVE) {
+      b->path[npath++] = insts[pc+1];
+      pc += 2;
+      continue;
+    } else if (op == JMP) {
+      pc += 2 + insts[pc+1];
+      continue;
+    } else if (op > JMP || op < 0) {
+      id = op < 0 ? -op : op;
+      if (b->mark[id] != b->gen) {
+        b->mark[id] = b->gen;
+        b->stack[si++] = op > JMP ? pc + 2 + insts[pc+1] : pc + 2;
+        b->stack[si++] = npath;
+        pc = op > JMP ? pc + 2 : pc + 2 + insts[pc+1];
+        continue;
+      }
+    } else if (op == BOL || op == EOL) {
+      if (op == BOL ? start : end) {
+        pc++;
+        continue;
+      }
+    } else {
+      return -1;
+    }
+    if (!si) return 0;
+    npath = b->stack[--si];
+    pc = b->stack[--si];
+  }
+}
+
+static ronepass *re_opcomp(rcode *prog, int nslot, int insensitive)
+{
+  ronbuild b;
+  ronepass *op = NULL;
+  ronstate states[ONEPASS_MAXSTATE];
+  unsigned int set[CLASSMAP];
+  int spc[ONEPASS_MAXSTATE], nstate = 1, cap = 8;
+  int *stid = NULL, *map = NULL, *tmp, i, k, c, pc, next, size;
+
+  if (prog->insts[0] != BOL) return NULL;
+  memset(&b, 0, sizeof(b));
+  b.insts = prog->insts;
+  b.nact = 1; /* acts[0] is the empty list */
+  b.capact = 64;
+  b.acts = calloc(b.capact, sizeof(int));
+  b.mark = calloc(prog->sparsesz, sizeof(int));
+  b.stack = malloc(prog->sparsesz * 2 * sizeof(int));
+  b.path = malloc(prog->unilen * sizeof(int));
+  b.epc = malloc(prog->unilen * sizeof(int));
+  b.eact = malloc(prog->unilen * sizeof(int));
+  stid = malloc(prog->unilen * sizeof(int));
+  map = calloc(cap * 256, sizeof(int));
+  if (!b.acts || !b.mark || !b.stack || !b.path || !b.epc || !b.eact || !stid || !map)
+    goto _done;
+  for (i = 0; i < prog->unilen; i++) stid[i] = -1;
+  spc[0] = 0;
+  stid[0] = 0;
+
+  for (i = 0; i < nstate; i++) {
+    if (_opclosure(&b, spc[i], !i, 1) < 0) goto _done;
+    states[i].endmatch = b.nent ? b.eact[0] : -1;
+    if (_opclosure(&b, spc[i], !i, 0) < 0) goto _done;
+    states[i].match = -1;
+    if (b.nent && prog->insts[b.epc[b.nent-1]] == MATCH)
+      states[i].match = b.eact[--b.nent];
+    for (k = 0; k < b.nent; k++) {
+      pc = b.epc[k];
+      next = pc + _inslen(&prog->insts[pc]);
+      if (stid[next] < 0) {
+        if (nstate == ONEPASS_MAXSTATE) goto _done;
+        if (nstate == cap) {
+          /* the transitions grow with the states */
+          tmp = realloc(map, cap * 2 * 256 * sizeof(int));
+          if (!tmp) goto _done;
+          map = tmp;
+          memset(map + cap * 256, 0, cap * 256 * sizeof(int));
+          cap *= 2;
+        }
+        spc[nstate] = next;
+        stid[next] = nstate++;
+      }
+      if (b.eact[k] >= 1 << 22) goto _done;
+      memset(set, 0, sizeof(set));
+      _opbytes(prog->insts, &prog->insts[pc], insensitive, set);
+      /* one-pass: no byte may be taken by two threads */
+      for (c = 0; c < 256; c++) {
+        if (!set[c >> 5]) { c |= 31; continue; }
+        if (!(set[c >> 5] >> (c & 31) & 1)) continue;
+        if (map[i*256+c]) goto _done;
+        map[i*256+c] = (b.eact[k] << 9) | (stid[next] + 1);
+      }
+    }
+  }
+
+  size = sizeof(ronepass) + (nstate * 2 + nstate * 256 + b.nact) * sizeof(int);
+  op = malloc(size);
+  if (!op) goto _done;
+  op->size = size;
+  op->nstate = nstate;
+  op->nslot = nslot;
+  op->map = nstate * 2;
+  op->acts = op->map + nstate * 256;
+  memcpy(op->data, states, nstate * sizeof(ronstate));
+  memcpy(op->data + op->map, map, nstate * 256 * sizeof(int));
+  memcpy(op->data + op->acts, b.acts, b.nact * sizeof(int));
+
+_done:
+  free(b.acts); free(b.mark); free(b.stack); free(b.path);
+  free(b.epc); free(b.eact); free(stid); free(map);
+  return op;
+}
+
+static int re_onepass(ronepass *op, const char *s, int len, const char **subp, int nsubp)
+{
+  ronstate *states = (ronstate *)op->data;
+  int *map = op->data + op->map, *acts = op->data + op->acts;
+  int *a, n, t, i, j, st = 0, matched = 0;
+  const char *sub[op->nslot], *msub[op->nslot];
+  const char *sp = s, *end = s + len;
+
+  memset(sub, 0, sizeof(sub));
+  sub[0] = s;
+  for (;; sp++) {
+    if (sp >= end) {
+      if (states[st].endmatch >= 0) {
+        memcpy(msub, sub, sizeof(sub));
+        for (a = &acts[states[st].endmatch], n = *a++; n--; a++) msub[*a] = sp;
+        matched = 1;
+      }
+      break;
+    }
+    if (states[st].match >= 0) {
+      memcpy(msub, sub, sizeof(sub));
+      for (a = &acts[states[st].match], n = *a++; n--; a++) msub[*a] = sp;
+      matched = 1;
+    }
+    t = map[st * 256 + (unsigned char)*sp];
+    if (!t) break;
+    if (OPACTS(t))
+      for (a = &acts[OPACTS(t)], n = *a++; n--; a++) sub[*a] = sp;
+    st = OPNEXT(t);
+  }
+  if (!matched) return 0;
+  for (i = 0, j = 0; i < nsubp; i += 2, j++) {
+    subp[i] = msub[j];
+    subp[i+1] = msub[nsubp / 2 + j];
+  }
+  return 1;
+}
+
+/*
+  Bit-parallel NFA for short unanchored patterns in binary mode. Its
+  states are the consuming instructions of the program (the positions of
+  the Glushkov automaton), a set of them fits in two words, and a step is
+  the union of the follow sets of the set, looked up by nibbles, masked by
+  the states that accept the byte. The sets do not keep the priority of
+  the threads, so the automaton only locates the match: a forward scan
+  finds the end of the earliest match, a backward scan from there finds
+  the earliest start of the threads still alive, and the VM begins at
+  that start since no thread before it can match.
+  Like racm, the block holds offsets only.
+*/
+#define BITPAR_MAXPOS 128
+#define BITPAR_SCAN 4096 /* bytes the VM scans alone before it is built */
+
+typedef struct rbpset rbpset;
+struct rbpset
+{
+  unsigned long long w[2];
+};
+
+typedef struct rbitpar rbitpar;
+struct rbitpar
+{
+  int size;      /* size of the whole block */
+  int nchunk;    /* number of nibbles in a set */
+  rbpset first;  /* states that begin a match */
+  rbpset final;  /* states followed by MATCH */
+  rbpset data[]; /* accept[256], follow[nchunk][16], precede[nchunk][16] */
+};
+
+#define BPSET(set, i) ((set).w[(i) >> 6] |= 1ULL << ((i) & 63))
+#define BPHAS(set, i) ((set).w[(i) >> 6] >> ((i) & 63) & 1)
+#define BPANY(a, b) (((a).w[0] & (b).w[0]) | ((a).w[1] & (b).w[1]))
+
+static int _bpclosure(const int *insts, int pc, const int *pos, int *mark, int gen, int *stack, rbpset *set)
+{
+  /* add the states reachable from pc without consuming to set, return 1
+     if MATCH is reachable, -1 if an assertion is */
+  int si = 0, matched = 0, op;
+  for (;;) {
+    /* each pc once, the targets of nested groups share their tails */
+    op = mark[pc] == gen ? 0 : insts[pc];
+    mark[pc] = gen;
+    if (op == SAVE) {
+      pc += 2;
+      continue;
+    } else if (op == JMP) {
+      pc += 2 + insts[pc+1];
+      continue;
+    } else if (op > JMP || op < 0) {
+      stack[si++] = pc + 2 + insts[pc+1];
+      pc += 2;
+      continue;
+    } else if (op == MATCH) {
+      matched = 1;
+    } else if (op == CHAR || op == CLASS || op == ANY) {
+      BPSET(*set, pos[pc]);
+    } else if (op) {
+      return -1;
+    }
+    if (!si) return matched;
+    pc = stack[--si];
+  }
+}
+
+static rbitpar *re_bpcomp(rcode *prog, int insensitive)
+{
+  int *insts = prog->insts, pcs[BITPAR_MAXPOS];
+  int *pos, *mark, *stack, npos = 0, gen = 0, pc, i, j, v, c, m, size;
+  rbpset follow[BITPAR_MAXPOS], precede[BITPAR_MAXPOS], first, final, *accept, *fol, *pre;
+  unsigned int set[CLASSMAP];
+  rbitpar *bp = NULL;
+
+  pos = malloc(prog->unilen * sizeof(int));
+  mark = calloc(prog->unilen, sizeof(int));
+  stack = malloc(prog->unilen * sizeof(int));
+  if (!pos || !mark || !stack) goto _done;
+  for (pc = 0; pc < prog->unilen; pc += _inslen(&insts[pc]))
+    if (insts[pc] == CHAR || insts[pc] == CLASS || insts[pc] == ANY) {
+      if (npos == BITPAR_MAXPOS) goto _done;
+      pcs[npos] = pc;
+      pos[pc] = npos++;
+    }
+
+  /* patterns that match the empty string gain nothing */
+  memset(&first, 0, sizeof(first));
+  memset(&final, 0, sizeof(final));
+  memset(follow, 0, sizeof(follow));
+  if (!npos || _bpclosure(insts, 0, pos, mark, ++gen, stack, &first)) goto _done;
+  for (i = 0; i < npos; i++) {
+    m = _bpclosure(insts, pcs[i] + _inslen(&insts[pcs[i]]), pos, mark, ++gen, stack, &follow[i]);
+    if (m < 0) goto _done;
+    if (m) BPSET(final, i);
+  }
+
+  size = sizeof(rbitpar) + (256 + (npos + 3) / 4 * 32) * sizeof(rbpset);
+  bp = calloc(1, size);
+  if (!bp) goto _done;
+  bp->size = size;
+  bp->nchunk = (npos + 3) / 4;
+  bp->first = first;
+  bp->final = final;
+  accept = bp->data;
+  fol = accept + 256;
+  pre = fol + bp->nchunk * 16;
+  for (i = 0; i < npos; i++) {
+    memset(set, 0, sizeof(set));
+    _opbytes(insts, &insts[pcs[i]], insensitive, set);
+    for (c = 0; c < 256; c++) {
+      if (!set[c >> 5]) { c |= 31; continue; }
+      if (set[c >> 5] >> (c & 31) & 1) BPSET(accept[c], i);
+    }
+  }
+  /* the precede sets are the follow sets transposed */
+  memset(precede, 0, npos * sizeof(rbpset));
+  for (j = 0; j < npos; j++)
+    for (i = 0; i < npos; i++)
+      if (BPHAS(follow[j], i)) BPSET(precede[i], j);
+  for (i = 0; i < npos; i++)
+    for (v = 0; v < 16; v++) {
+      if (!(v >> (i & 3) & 1)) continue;
+      fol[i / 4 * 16 + v].w[0] |= follow[i].w[0];
+      fol[i / 4 * 16 + v].w[1] |= follow[i].w[1];
+      pre[i / 4 * 16 + v].w[0] |= precede[i].w[0];
+      pre[i / 4 * 16 + v].w[1] |= precede[i].w[1];
+    }
+
+_done:
+  free(pos); free(mark); free(stack);
+  return bp;
+}
+
+static void _bpunion(const rbpset *tab, const rbpset *d, rbpset *f)
+{
+  /* f |= union of the sets in tab for the states in d */
+  unsigned long long x;
+  int i, k;
+  for (i = 0; i < 2; i++)
+    for (x = d->w[i], k = i * 16 * 16; x; x >>= 4, k += 16)
+      if (x & 15) {
+        f->w[0] |= tab[k + (x & 15)].w[0];
+        f->w[1] |= tab[k + (x & 15)].w[1];
+      }
+}
+
+static const char *re_bitpar(rbitpar *bp, const char *s, int len)
+{
+  /* return where the VM should begin, NULL if nothing matches */
+  const rbpset *accept = bp->data, *follow = accept + 256;
+  const rbpset *precede = follow + bp->nchunk * 16, *a;
+  const unsigned char *sp = (const unsigned char *)s, *end = sp + len;
+  const char *from = s;
+  rbpset d, f;
+
+  memset(&d, 0, sizeof(d));
+  for (;;) {
+    if (!(d.w[0] | d.w[1]))
+      while (sp < end && !BPANY(accept[*sp], bp->first)) sp++;
+    if (sp == end) return NULL;
+    f = bp->first;
+    _bpunion(follow, &d, &f);
+    a = &accept[*sp++];
+    d.w[0] = f.w[0] & a->w[0];
+    d.w[1] = f.w[1] & a->w[1];
+    if (BPANY(d, bp->final)) break;
+  }
+  for (;;) {
+    if (BPANY(d, bp->first)) from = (const char *)sp - 1;
+    if (--sp == (const unsigned char *)s) break;
+    memset(&f, 0, sizeof(f));
+    _bpunion(precede, &d, &f);
+    a = &accept[sp[-1]];
+    d.w[0] = f.w[0] & a->w[0];
+    d.w[1] = f.w[1] & a->w[1];
+    if (!(d.w[0] | d.w[1])) break;
+  }
+  return from;
+}
+
+static void *re_dupblock(void *block)
+{
+  /* engine blocks begin with their size and hold no pointers */
+  void *p = malloc(*(int *)block);
+  if (p) memcpy(p, block, *(int *)block);
+  return p;
+}
+
 typedef struct RE RE;
 struct RE {
   const char **captures;
   char* buffer;
+  racm *ac;
+  ronepass *onepass;
+  rbitpar *bitpar;
+  rskip *skip;
+  int built; /* onepass and skip were tried, see re_build */
+  int scanned; /* bytes given to the VM while bitpar is pending, -1 = not */
+  void *vm; /* scratch of re_pikevm, when too large for the stack */
   int count;
   int sub_els;
   int insensitive;
@@ -749,35 +1978,95 @@ struct RE {
 };
 
 RE* re_compile(const char *pattern, int insensitive, int utf8) {
-  int sub_els;
-  int sz = re_sizecode(pattern, &sub_els, utf8) * sizeof(int);
-  if (sz < 0) return NULL;
-  int count = (sub_els + 1) * 2;
-  int captures_size = count * sizeof(char*);
-  int buffer_size = sizeof(rcode) + sz;
+  int sub_els, classes = 0, sz = 0, count, captures_size, buffer_size;
+  rtree tree;
+  RE *re;
+  memset(&tree, 0, sizeof(tree));
+  racm *ac = re_accomp(pattern, insensitive, utf8, &sub_els);
+  if (!ac) {
+    if (re_parse(&tree, pattern, utf8, insensitive) < 0) goto _fail;
+    sub_els = tree.nsub;
+    /* room for the final SAVE and MATCH before the class table */
+    classes = tree.nodes[tree.root].size + 3;
+    sz = (classes + tree.clen) * sizeof(int);
+  }
+  count = (sub_els + 1) * 2;
+  captures_size = count * sizeof(char*);
+  buffer_size = ac ? 0 : sizeof(rcode) + sz;
 
-  RE* re = (RE*) malloc(sizeof(RE) + captures_size + buffer_size);
-  if(!re) return NULL;
+  re = (RE*) malloc(sizeof(RE) + captures_size + buffer_size);
+  if(!re) {
+    free(ac);
+    goto _fail;
+  }
 
   re->sub_els = sub_els;
   re->captures = (const char**) (((char*)re) + sizeof(RE));
   re->buffer = (char*) re + sizeof(RE) + captures_size;
+  re->ac = ac;
+  re->onepass = NULL;
+  re->bitpar = NULL;
+  re->skip = NULL;
+  re->built = !!ac;
+  re->scanned = -1;
+  re->vm = NULL;
   re->count = count;
   re->insensitive = insensitive;
   re->utf8 = utf8;
   re->size = sizeof(RE) + captures_size + buffer_size;
 
-  if (re_comp((rcode *)re->buffer, pattern, sub_els, utf8)) {
+  if (!ac && re_comp((rcode *)re->buffer, &tree, classes)) {
     free(re);
-    return NULL;
+    goto _fail;
   }
+  free(tree.nodes);
+  free(tree.cls);
   return re;
+
+_fail:
+  free(tree.nodes);
+  free(tree.cls);
+  return NULL;
+}
+
+static void re_build(RE *re)
+{
+  /* the engines beside the VM are built on the first match, so a pattern
+     compiled for a single call does not pay for the ones it cannot use */
+  rcode *prog = (rcode *)re->buffer;
+  re->built = 1;
+  if (!re->utf8) {
+    re->onepass = re_opcomp(prog, re->count, re->insensitive);
+    /* bitpar only pays off on long texts, re_match builds it later */
+    if (!re->onepass)
+      re->scanned = 0;
+  }
+  if (!re->onepass)
+    re->skip = re_skipcomp(prog, re->insensitive, re->utf8);
 }
 
 RE* re_dup(RE* re) {
   if (!re || re->size == 0) return NULL;
   RE* newre = malloc(re->size);
+  if (!newre) return NULL;
   memcpy(newre, re, re->size);
+  /* captures and buffer live in the same block, point them to the copy */
+  newre->captures = (const char**) (((char*)newre) + sizeof(RE));
+  newre->buffer = (char*) newre->captures + re->count * sizeof(char*);
+  newre->ac = re->ac ? re_dupblock(re->ac) : NULL;
+  newre->onepass = re->onepass ? re_dupblock(re->onepass) : NULL;
+  newre->bitpar = re->bitpar ? re_dupblock(re->bitpar) : NULL;
+  newre->skip = re->skip ? re_dupblock(re->skip) : NULL;
+  newre->vm = NULL;
+  if ((re->ac && !newre->ac) || (re->onepass && !newre->onepass) ||
+      (re->bitpar && !newre->bitpar) || (re->skip && !newre->skip)) {
+    free(newre->ac);
+    free(newre->onepass);
+    free(newre->bitpar);
+    free(newre->skip);
+    free(newre);
+    return NULL;
+  }
   return newre;
 }
 
@@ -795,6 +2084,11 @@ int re_uc_len(RE* re, const char * s) {
 }
 
 void re_free(RE* re) {
+  free(re->ac);
+  free(re->onepass);
+  free(re->bitpar);
+  free(re->skip);
+  free(re->vm);
   free(re);
 }
 
@@ -802,7 +2096,38 @@ const char** re_match(RE* re, const char* string, int len, const char* cont) {
   if (re == NULL) return NULL;
 
   memset(re->captures, 0, re->count * sizeof(char*));
-  int sz = re_pikevm((rcode *)re->buffer, string, len, re->captures, re->count, re->insensitive, re->utf8, cont);
+  if (re->ac) {
+    if (!re_acmatch(re->ac, string, len, re->captures, re->count, cont)) return NULL;
+    return re->captures;
+  }
+  if (!re->built) re_build(re);
+  if (re->onepass) {
+    if (!re_onepass(re->onepass, string, len, re->captures, re->count)) return NULL;
+    return re->captures;
+  }
+  if (re->scanned >= 0 && len >= BITPAR_SCAN - re->scanned) {
+    re->scanned = -1;
+    re->bitpar = re_bpcomp((rcode *)re->buffer, re->insensitive);
+  } else if (re->scanned >= 0) {
+    re->scanned += len;
+  }
+  if (re->bitpar) {
+    const char *from = re_bitpar(re->bitpar, string, len);
+    if (!from) return NULL;
+    len -= from - string;
+    string = from;
+  }
+  rcode *prog = (rcode *)re->buffer;
+  size_t vmsize = re_vmsize(prog);
+  int sz;
+  if (vmsize > VMSTACK) {
+    /* kept for the next match, re_free releases it */
+    if (!re->vm && !(re->vm = malloc(vmsize))) return NULL;
+    sz = re_pikevm(prog, string, len, re->captures, re->count, re->insensitive, re->utf8, cont, re->skip, re->vm);
+  } else {
+    void *stack[vmsize / sizeof(void*) + 1];
+    sz = re_pikevm(prog, string, len, re->captures, re->count, re->insensitive, re->utf8, cont, re->skip, stack);
+  }
 
   if (!sz) return NULL;
   return re->captures;
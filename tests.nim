@@ -7,6 +7,7 @@
 
 import tinyre
 import std/[unittest, strformat]
+from std/strutils import repeat
 from std/re as pcre import nil
 
 # some source for the tests:
@@ -690,6 +691,116 @@ suite "Test Suite for TinyRE":
       output(re"a{1,}?b", "aaaab") == "(0,5)"
       output(re"a{1,3}?b", "aaaab") == "(1,5)"
 
+  test "Test Literal Alternation":
+    check:
+      output(re"foo|bar|baz", "xxbazbar") == "(2,5)"
+      output(re"a|ab", "ab") == "(0,1)"
+      output(re"ab|a", "ab") == "(0,2)"
+      output(re"bc|abcd", "abcd") == "(0,4)"
+      output(re"abcd|bc", "abce") == "(1,3)"
+      output(re"(foo|bar)", "a bar") == "(2,5)(2,5)"
+      output(re"(?:foo|bar)", "a bar") == "(2,5)"
+      output(reI"foo|bar", "a BaR") == "(2,5)"
+      output(re"\.|\x61", "b.a") == "(1,2)"
+      output(re"foo|bar", "fobar") == "(2,5)"
+      output(re"foo|bar", "fooba") == "(0,3)"
+      output(re"foo|bar", "fob") == ""
+      match("中文測試", reGU"測|文") == @["文", "測"]
+      match("x\u00e9x", reU"\xE9|y") == @["\u00e9"]
+      output(re"\b(?:cat|category)\b", "categoryx category") == "(10,18)"
+      output(re"\b(foo|bar)", "xfoo bar") == "(5,8)(5,8)"
+      output(re"^(?:foo|bar)$", "bar") == "(0,3)"
+      output(re"^(?:foo|bar)$", "bar ") == ""
+      match("cat concat cats cat.", reG"\b(?:cat|cats)\b") == @["cat", "cats", "cat"]
+
+    var pattern = "(?:"
+    for i in 0 ..< 5000:
+      if i != 0: pattern.add '|'
+      pattern.add fmt"w{i}x"
+    pattern.add ')'
+    check:
+      match("a w123x w4999x w5000x", reG(pattern)) == @["w123x", "w4999x"]
+      match("W42X", reI(pattern)) == @["W42X"]
+      not contains("w5000x w-1x", re(pattern))
+      match("w1x w12xy w4999x.", reG("\\b" & pattern & "\\b")) == @["w1x", "w4999x"]
+
+  test "Test One-pass Patterns":
+    check:
+      output(re"^(\d{4})-(\d{2})-(\d{2})$", "2024-08-11") == "(0,10)(0,4)(5,7)(8,10)"
+      output(re"^([A-Za-z-]+):(.*)$", "Host:example.com") == "(0,16)(0,4)(5,16)"
+      output(reI"^GET (/\w*)", "get /index") == "(0,10)(4,10)"
+      output(re"^(a|b)*c", "ababc") == "(0,5)(3,4)"
+      output(re"^a*$", "aab") == ""
+      output(re"^(ab)*", "ababa") == "(0,4)(2,4)"
+      output(re"^(a+)(b)?", "aac") == "(0,2)(0,2)(?,?)"
+      output(re"^(?:(a)|b)+$", "ab") == "(0,2)(0,1)"
+      output(re"^x*", "") == "(0,0)"
+
+    if "Content-Length: 42" =~ re"^Content-Length: (\d+)$":
+      check matches == @["Content-Length: 42", "42"]
+    else:
+      fail()
+
+  test "Test Bit-parallel Patterns":
+    let
+      digits = "1".repeat(100)
+      filler = "-".repeat(4096) # long enough for the automaton to be built
+    check:
+      output(re"\d{3}-\d{4}", "call 555-1234 now") == "(5,13)"
+      output(re"([A-Z]{2})(\d+)", "id: AB12, CD3") == "(4,8)(4,6)(6,8)"
+      output(re"a.*z|b", "a b z") == "(0,5)"
+      output(re"(a|ab)(c|bcd)", "xabcd") == "(1,5)(1,2)(2,5)"
+      output(reI"[a-z]+\d", "ABC1 xyZ2") == "(0,4)"
+      output(re"X\d{100}", digits & "X" & digits) == "(100,201)"
+      find("aaaa", re"a\d") == -1
+      "a1 b22 c333".bounds(reG"[a-z]\d+") == @[0..1, 3..5, 7..10]
+      output(re"\d{3}-\d{4}", filler & "call 555-1234 now") == "(4101,4109)"
+      output(re"(a|ab)(c|bcd)", filler & "xabcd") == "(4097,4101)(4097,4098)(4098,4101)"
+      output(reI"[a-z]+\d", filler & "ABC1 xyZ2") == "(4096,4100)"
+      find(filler & "aaaa", re"a\d") == -1
+      (filler & "a1 b22").bounds(reG"[a-z]\d+") == @[4096..4097, 4099..4101]
+
+  test "Test Run Skipping":
+    let
+      field = "a".repeat(100)
+      spaces = " ".repeat(50)
+      # a thread about to match sits behind the loop thread
+      pending = "BbbbcbccccABbccCBccccbAbcBcBbABCbBbbcBbAccbCcbcacbcbAAcbccccbBbBbc" &
+        "bccccCbaAcaCbbcBCabCbcbbcccacbbbcccbbbbbccbcBcabccbaaccCbAcbBBcBccacCbAb"
+    check:
+      output(re"\"[^\"]*\"", "x \"" & field & "\" y") == "(2,104)"
+      output(re"(\w+):\s+(\w+)", "key:" & spaces & "value") == "(0,59)(0,3)(54,59)"
+      output(re"<[^>]*>\s*(\w+)", "<p " & field & ">" & spaces & "hi") == "(0,156)(154,156)"
+      output(re"a.*$", "xa" & field) == "(1,102)"
+      find("\"" & field, re"\"[^\"]*\"") == -1
+      match("\"我" & field & "我\"", reU"\"([^\"]*)\"") == @["\"我" & field & "我\"", "我" & field & "我"]
+      output(re".+[^a](b(?:a\w+|1)abc)??", pending) == "(0,138)(?,?)"
+      output(reU".+[^a](b(?:a\w+|1)abc)??", pending) == "(0,138)(?,?)"
+      "\"" & field & "\" \"\" \"b\"".bounds(reG"\"[^\"]*\"") == @[0..101, 103..104, 106..108]
+
+  test "Test Large Patterns":
+    var alternation = "(?:"
+    for i in 0 ..< 6000:
+      if i != 0: alternation.add '|'
+      alternation.add fmt"w{i}x\d"
+    alternation.add ')'
+    var groups = "(?:"
+    for i in 0 ..< 300:
+      if i != 0: groups.add '|'
+      groups.add fmt"(w{i}x[a-z]*\s?)+"
+    groups.add ')'
+    let nested = "(?:".repeat(3000) & "a" & ")?".repeat(3000) & "b"
+    let captures = match("-- w299xab w299x", re(groups))
+    check:
+      match("a w123x4 w5999x0 w6000x1", reG(alternation)) == @["w123x4", "w5999x0"]
+      captures.len == 301
+      captures[0] == "w299xab w299x"
+      captures[300] == "w299x"
+      output(re(nested), "xab") == "(1,3)"
+      output(re(nested), "b") == "(0,1)"
+    expect ValueError: discard re"(*a)"
+    expect ValueError: discard re"(+a)"
+
   test "Test Binary/Unicode Mode":
     check:
       match("\0\0\0", reG"\x00") == @["\0", "\0", "\0"]
@@ -809,3 +920,21 @@ suite "Test Suite for TinyRE":
       replacef("abc", re"(d)", "m($1)") == "abc"
       replacef("aaa", re"a", "b") == "bbb"
       replacef("aaa", re"a", "b", 1) == "baa"
+
+  test "Test replacef() Templates":
+    check:
+      replacef("abc", re"(a)(b)(c)", "$3$2$1") == "cba"
+      replacef("abc", re"(a)(b)(c)", "$#$#") == "ab"
+      replacef("abc", re"(a)(b)(c)", "${3}${-3}") == "ca"
+      replacef("abc", re"(a)(b)(c)", "$-1$$") == "c$"
+      replacef("abc", re"(b)", "$") == "a$c"
+      replacef("ab", re"(a)|(b)", "[$1$2]") == "[a][b]"
+      replacef("a1b2", reG"([a-z])(\d)", reTemplate("$2$1", re"([a-z])(\d)")) == "1a2b"
+      multiReplace("a1b2", [(re"\d", "#"), (re"([a-z])", "<$1>")]) == "<a>#<b>#"
+      multiReplace("a1b2", [(re"(\d)", reTemplate("[$1]", re"(\d)"))]) == "a[1]b[2]"
+      multiReplace("a1b2!", [(re"2", "two"), (reG"\d", "<$1>")]) == "a<2>btwo!"
+
+    expect ValueError: discard reTemplate("$2", re"(a)")
+    expect ValueError: discard reTemplate("$x", re"(a)")
+    expect ValueError: discard replacef("a", re"(a)", "$2")
+    expect ValueError: discard replacef("a", re"(a)", "${name}")
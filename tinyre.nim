@@ -99,6 +99,13 @@ type
     rgIncludeLastEmpty
     rgExcludeLastEmpty
 
+  ReTemplate* = object
+    ## Pre-parsed replacement string for `replacef` and `multiReplace`.
+    parts: seq[tuple[literal: string, group: int]] # -1 = none, -2 = last
+    maxGroup: int
+    maxBack: int # largest N of $-N
+    invalid: bool
+
 proc re_compile(pattern: cstring, i: cint, u: cint): ReRaw {.importc, cdecl.}
 proc re_free(re: ReRaw) {.importc, cdecl.}
 proc re_dup(re: ReRaw): ReRaw {.importc, cdecl.}
@@ -380,41 +387,148 @@ proc replace*(s: string, sub: Re, by: string = "", limit = 0): string =
 
   result.add s[pos..^1]
 
-proc replacef*(s: string, sub: Re, by: string = "", limit = 0): string =
-  ## Replaces `sub` in `s` by the string `by`. Captures can be accessed in `by`
-  ## with the notation `$i` and `$#` (see strutils.\`%\`).
+proc parseTemplate(by: string): ReTemplate =
+  # same syntax as strutils.addf without names: $1, $-1, ${1}, ${-1}, $#
+  # and $$. Groups are stored as indices of the captures (0 = entire
+  # match), $-N as -N-1 since the number of captures is only known when
+  # the template is applied.
+  var
+    literal = ""
+    i = 0
+    num = 0
+
+  while i < by.len:
+    if by[i] != '$' or i + 1 >= by.len:
+      literal.add by[i]
+      i.inc
+      continue
+
+    var index, back = -1
+    case by[i + 1]
+    of '$':
+      literal.add '$'
+      i.inc(2)
+      continue
 
-  # carefully deal with matches, so that $1 = matches[1] (by default is matches[0])
+    of '#':
+      index = num
+      num.inc
+      i.inc(2)
+
+    of '1'..'9', '-':
+      i.inc
+      let negative = by[i] == '-'
+      if negative: i.inc
+      var j = 0
+      while i < by.len and by[i] in Digits:
+        j = j * 10 + ord(by[i]) - ord('0')
+        i.inc
+      if negative: back = j else: index = j - 1
+
+    of '{':
+      var j = i + 2
+      let negative = j < by.len and by[j] == '-'
+      if negative: j.inc
+      var k, digits = 0
+      while j < by.len and by[j] in Digits:
+        k = k * 10 + ord(by[j]) - ord('0')
+        digits.inc
+        j.inc
+      if digits == 0 or j >= by.len or by[j] != '}':
+        result.invalid = true
+        return
+      if negative: back = k else: index = k - 1
+      i = j + 1
+
+    else:
+      result.invalid = true
+      return
+
+    if back > 0:
+      result.parts.add (move literal, -back - 1)
+      result.maxBack = max(result.maxBack, back)
+    elif index >= 0:
+      result.parts.add (move literal, index + 1)
+      result.maxGroup = max(result.maxGroup, index + 1)
+    else:
+      result.invalid = true
+      return
+    literal = ""
+
+  result.parts.add (literal, -1)
+
+proc fits(by: ReTemplate, captures: int): bool {.inline.} =
+  # whether `by` only refers to the first `captures` captures
+  not by.invalid and by.maxGroup < captures and by.maxBack < captures
+
+proc reTemplate*(by: string, pattern: Re): ReTemplate =
+  ## Parses the replacement string `by` for `pattern` once, so that it can be
+  ## reused by `replacef` and `multiReplace`. Raises `ValueError` if `by` is
+  ## malformed or refers to a group that `pattern` does not have.
+  result = parseTemplate(by)
+  if not result.fits(pattern.groupsCount()):
+    raise newException(ValueError, "invalid format string")
+
+proc addSlice(result: var string, s: string, a, b: int) {.inline.} =
+  # appends s[a..b] without the temporary string of slicing
+  if b >= a:
+    let L = result.len
+    result.setLen(L + b - a + 1)
+    copyMem(addr result[L], unsafeAddr s[a], b - a + 1)
+
+proc addTemplate(result: var string, s: string, by: ReTemplate,
+    captures: openArray[Slice[int]]) =
+  if not by.fits(captures.len):
+    raise newException(ValueError, "invalid format string")
+
+  for part in by.parts:
+    result.add part.literal
+    if part.group != -1:
+      let slice = captures[
+        if part.group >= 0: part.group else: captures.len + part.group + 1]
+      if slice.a >= 0: # matched
+        result.addSlice(s, slice.a, slice.b)
+
+proc replacefImpl(s: string, sub: Re, by: ReTemplate, limit: int): string =
   let
     cs = s.cstring
     groupsCount = sub.groupsCount()
 
   var
-    matches = newSeq[string](groupsCount - 1)
+    captures = newSeq[Slice[int]](groupsCount)
     index = 0
     count = 0
     pos = 0
-    slice0 = -1 .. -1
 
+  result = newStringOfCap(s.len)
   for slice in matchRaw(cs, s.len, sub.raw, rgExcludeLastEmpty, true):
-    if slice0.a < 0: slice0 = slice
-    if index >= 1 and slice.b >= slice.a and slice.a >= 0: # not empty match
-      matches[index - 1] = s[slice]
-
+    captures[index] = slice
     index.inc
-    if index > matches.len:
-      if slice0.a >= 0:
-        result.add s[pos..slice0.a - 1]
-        result.addf(by, matches)
-        pos = slice0.b + 1
+    if index == groupsCount:
+      if captures[0].a >= 0:
+        result.addSlice(s, pos, captures[0].a - 1)
+        result.addTemplate(s, by, captures)
+        pos = captures[0].b + 1
 
       index = 0
-      slice0 = -1 .. -1
-      matches = newSeq[string](groupsCount - 1)
       count.inc
       if limit > 0 and count >= limit: break
 
-  result.add s[pos..^1]
+  result.addSlice(s, pos, s.high)
+
+proc replacef*(s: string, sub: Re, by: string = "", limit = 0): string =
+  ## Replaces `sub` in `s` by the string `by`. Captures can be accessed in `by`
+  ## with `$1`, `${1}` (the first group), `$-1`, `${-1}` (the last group) and
+  ## `$#` (the next group), `$$` is a literal `$`. Named references of
+  ## strutils.\`%\` (`$name`, `${name}`) are not supported and raise
+  ## `ValueError`.
+  result = replacefImpl(s, sub, parseTemplate(by), limit)
+
+proc replacef*(s: string, sub: Re, by: ReTemplate, limit = 0): string =
+  ## Same as above, but `by` is a template parsed by `reTemplate`.
+  if not by.fits(sub.groupsCount()):
+    raise newException(ValueError, "invalid format string")
+  result = replacefImpl(s, sub, by, limit)
 
 proc replace*(s: string, sub: Re,
     by: proc (n: int, matches: openArray[string]): string,
@@ -453,24 +567,67 @@ proc replace*(s: string, sub: Re,
 
   result.add s[pos..^1]
 
-proc multiReplace*(s: string, subs: openArray[tuple[re: Re, by: string]]): string =
-  ## Returns a modified copy of `s` with the substitutions in `subs`
-  ## applied in parallel.
-  var pos = 0
+proc multiReplaceImpl(s: string, subs: openArray[ReRaw],
+    rgs: openArray[ReGlobalKind], templates: openArray[ReTemplate]): string =
+  var
+    captures: seq[Slice[int]]
+    pos = 0
+
+  result = newStringOfCap(s.len)
   while pos < s.len:
     block searchSubs:
+      let cs = cast[cstring](cast[int](s.cstring) +% pos)
       for i in 0..<subs.len:
-        if s.startsWith(subs[i].re, pos): # optimize it?
-          var matches = s.match(subs[i].re, pos)
-          if matches[0].len != 0:
-            addf(result, subs[i].by, matches[1..^1])
-            pos.inc(matches[0].len)
-            break searchSubs
+        captures.setLen(0)
+        for slice in matchRaw(cs, s.len - pos, subs[i], rgs[i], true):
+          # the first match must be a non-empty one at pos, the later ones
+          # of a global pattern are only listed for the match replaced
+          if captures.len == 0 and (slice.a != 0 or slice.b < 0): break
+          captures.add if slice.a >= 0: (slice.a + pos) .. (slice.b + pos) else: slice
+
+        if captures.len != 0:
+          result.addTemplate(s, templates[i], captures)
+          pos = captures[0].b + 1
+          break searchSubs
 
       result.add s[pos]
       pos.inc
 
-  result.add s[pos..^1]
+  result.addSlice(s, pos, s.high)
+
+proc multiReplace*(s: string, subs: openArray[tuple[re: Re, by: string]]): string =
+  ## Returns a modified copy of `s` with the substitutions in `subs`
+  ## applied in parallel. `by` has the same syntax as in `replacef`. With
+  ## `reGlobal`, the captures of the following matches come after the ones
+  ## of the match being replaced.
+  var
+    raws = newSeq[ReRaw](subs.len)
+    rgs = newSeq[ReGlobalKind](subs.len)
+    templates = newSeq[ReTemplate](subs.len)
+
+  for i in 0..<subs.len:
+    raws[i] = subs[i].re.raw
+    rgs[i] = if subs[i].re.global: rgIncludeLastEmpty else: rgNone
+    templates[i] = parseTemplate(subs[i].by)
+
+  result = multiReplaceImpl(s, raws, rgs, templates)
+
+proc multiReplace*(s: string, subs: openArray[tuple[re: Re, by: ReTemplate]]): string =
+  ## Same as above, but the replacements are templates parsed by `reTemplate`.
+  var
+    raws = newSeq[ReRaw](subs.len)
+    rgs = newSeq[ReGlobalKind](subs.len)
+    templates = newSeq[ReTemplate](subs.len)
+
+  for i in 0..<subs.len:
+    # the captures of a global pattern are only known when it matches
+    if not subs[i].re.global and not subs[i].by.fits(subs[i].re.groupsCount()):
+      raise newException(ValueError, "invalid format string")
+    raws[i] = subs[i].re.raw
+    rgs[i] = if subs[i].re.global: rgIncludeLastEmpty else: rgNone
+    templates[i] = subs[i].by
+
+  result = multiReplaceImpl(s, raws, rgs, templates)
 
 template `=~`*(s: string, pattern: Re, start = 0): untyped =
   ## This calls `match` with an implicit declared `matches` seq that